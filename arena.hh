@@ -0,0 +1,125 @@
+#ifndef __arena_h__
+#define __arena_h__
+
+// Bump allocator for the nodes of one compilation.
+//
+// Memory is taken from large blocks and only given back when the arena is
+// destroyed, all at once. Destructors of the objects are never run, so only
+// objects that own nothing outside the arena may be put in it: AST nodes keep
+// their children as pointers or AstLists into the same arena and their text
+// as views of the source buffer or of strings copied with Str().
+class AstArena {
+public:
+    explicit AstArena(size_t block_size = 64 * 1024) : m_block_size(block_size) { }
+    AstArena(AstArena const&) = delete;
+    AstArena& operator=(AstArena const&) = delete;
+
+    void* Allocate(size_t size, size_t align) {
+        auto p = reinterpret_cast<uintptr_t>(m_current);
+        auto aligned = (p + align - 1) & ~uintptr_t(align - 1);
+        if(!m_current || aligned + size > reinterpret_cast<uintptr_t>(m_end)) {
+            NewBlock(size + align);
+            p = reinterpret_cast<uintptr_t>(m_current);
+            aligned = (p + align - 1) & ~uintptr_t(align - 1);
+        }
+        m_current = reinterpret_cast<char*>(aligned + size);
+        m_used+= size;
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    template<typename T, typename... Args>
+    T* New(Args&&... args) {
+        return new(Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    //Copies str into the arena
+    std::string_view Str(std::string_view str) {
+        auto data = static_cast<char*>(Allocate(str.size(), 1));
+        std::copy(str.begin(), str.end(), data);
+        return std::string_view(data, str.size());
+    }
+
+    // Takes over the blocks of other, so nodes allocated in it live as long as
+    // this arena. other is left empty.
+    void Adopt(AstArena& other) {
+        for(auto& block : other.m_blocks)
+            m_blocks.push_back(std::move(block));
+        m_used+= other.m_used;
+        m_reserved+= other.m_reserved;
+        other.m_blocks.clear();
+        other.m_current = other.m_end = nullptr;
+        other.m_used = other.m_reserved = 0;
+    }
+
+    //Bytes handed out, and bytes taken from the heap for them
+    size_t BytesUsed() const { return m_used; }
+    size_t BytesReserved() const { return m_reserved; }
+
+protected:
+    void NewBlock(size_t min_size) {
+        size_t size = std::max(m_block_size, min_size);
+        m_blocks.emplace_back(new char[size]);
+        m_current = m_blocks.back().get();
+        m_end = m_current + size;
+        m_reserved+= size;
+    }
+
+    size_t m_block_size;
+    std::vector<std::unique_ptr<char[]>> m_blocks;
+    char* m_current = nullptr;
+    char* m_end = nullptr;
+    size_t m_used = 0;
+    size_t m_reserved = 0;
+};
+
+// A fixed array of nodes in an AstArena
+template<typename T>
+struct AstList {
+    T const* items = nullptr;
+    uint32_t count = 0;
+
+    T const* begin() const { return items; }
+    T const* end() const { return items + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T const& operator[](size_t i) const { return items[i]; }
+    T const& back() const { return items[count - 1]; }
+};
+
+// Collects the items of an AstList while parsing. Items are pushed on a
+// scratch vector shared by all builders of the same type, which works as a
+// stack since a list nested in another is finished before the outer one gets
+// its next item. List() copies the items into the arena at their final size
+// and pops them; a builder dropped without calling it pops them as well.
+template<typename T>
+class AstListBuilder {
+public:
+    AstListBuilder(std::vector<T>& scratch, AstArena& arena) : m_scratch(scratch), m_arena(arena), m_first(scratch.size()) { }
+    AstListBuilder(AstListBuilder const&) = delete;
+    ~AstListBuilder() { m_scratch.resize(m_first); }
+
+    void push_back(T const& item) { m_scratch.push_back(item); }
+    void push_back(T&& item) { m_scratch.push_back(std::move(item)); }
+
+    size_t size() const { return m_scratch.size() - m_first; }
+    T const* begin() const { return m_scratch.data() + m_first; }
+    T const* end() const { return m_scratch.data() + m_scratch.size(); }
+
+    AstList<T> List() {
+        auto count = uint32_t(size());
+        T* items = nullptr;
+        if(count) {
+            items = static_cast<T*>(m_arena.Allocate(sizeof(T) * count, alignof(T)));
+            std::uninitialized_copy(begin(), end(), items);
+        }
+        m_scratch.resize(m_first);
+        return AstList<T> { items, count };
+    }
+
+protected:
+    std::vector<T>& m_scratch;
+    AstArena& m_arena;
+    size_t m_first;
+};
+
+#endif //__arena_h__
@@ -0,0 +1,359 @@
+#ifndef __astfile_h__
+#define __astfile_h__
+
+// A flat AST saved as one binary image, so a parse can be cached on disk and
+// used again by another process without lexing or parsing.
+//
+// The image is a header followed by the columns of the FlatAst, each section
+// 8-byte aligned and found by its offset from the start of the image. Nodes
+// link to each other by index, never by address, so nothing is patched on
+// load: a MappedAst maps the file read-only and points its columns straight
+// into the mapping. Names and string literals are stored once each in a
+// string table, the symbol and string columns hold indexes into it. Only the
+// names are interned when the image is loaded, one lookup per distinct name.
+//
+// The image is in the byte order of the writer and stamped with a version and
+// the number of node kinds; a reader only accepts an image it would have
+// written itself. Whether the image is older than its source is up to the
+// caller to decide.
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ASTFILE_HAVE_MMAP 1
+#endif
+#include <fstream>
+#include <sstream>
+
+const uint32_t ast_file_version = 1;
+const uint32_t ast_file_byte_order = 0x01020304;
+
+struct AstFileHeader {
+    char magic[4];          //"GCA" and a zero
+    uint32_t byte_order;    //ast_file_byte_order as the writer stored it
+    uint32_t version;
+    uint32_t kind_count;    //F_KIND_COUNT of the writer
+    uint32_t size;          //Bytes of the whole image
+
+    uint32_t node_count;
+    uint32_t symbol_count;
+    uint32_t number_count;
+    uint32_t string_count;
+    uint32_t table_count;   //Entries of the string table
+    uint32_t name_count;    //The first name_count entries are names
+    uint32_t text_size;
+
+    //Offsets of the sections from the start of the image
+    uint32_t kinds;
+    uint32_t flags;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t offsets;
+    uint32_t payloads;
+    uint32_t symbols;       //Index into the string table per entry of FlatAst::symbols
+    uint32_t numbers;
+    uint32_t strings;       //Index into the string table per entry of FlatAst::strings
+    uint32_t table;         //AstFileString per entry
+    uint32_t text;          //Characters of all entries, back to back
+};
+
+// An entry of the string table, its offset is from the start of the text
+struct AstFileString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+static_assert(std::is_trivially_copyable<AstFileHeader>::value, "AstFileHeader is written as is");
+
+// Builds the image of a flat AST
+std::string SerializeAst(FlatAst const& ast) {
+    std::unordered_map<std::string_view, uint32_t> entries;
+    std::vector<std::string_view> table;
+    auto intern = [&](std::string_view str) {
+        auto result = entries.emplace(str, uint32_t(table.size()));
+        if(result.second)
+            table.push_back(str);
+        return result.first->second;
+    };
+
+    std::vector<uint32_t> symbols, strings;
+    symbols.reserve(ast.symbols.size());
+    for(auto symbol : ast.symbols)
+        symbols.push_back(intern(symbol.view()));
+    auto name_count = uint32_t(table.size());
+    strings.reserve(ast.strings.size());
+    for(auto str : ast.strings)
+        strings.push_back(intern(str));
+
+    std::vector<AstFileString> table_entries;
+    std::string text;
+    table_entries.reserve(table.size());
+    for(auto str : table) {
+        table_entries.push_back(AstFileString { uint32_t(text.size()), uint32_t(str.size()) });
+        text += str;
+    }
+
+    AstFileHeader header = {};
+    std::memcpy(header.magic, "GCA", 4);
+    header.byte_order = ast_file_byte_order;
+    header.version = ast_file_version;
+    header.kind_count = F_KIND_COUNT;
+    header.node_count = uint32_t(ast.size());
+    header.symbol_count = uint32_t(symbols.size());
+    header.number_count = uint32_t(ast.numbers.size());
+    header.string_count = uint32_t(strings.size());
+    header.table_count = uint32_t(table_entries.size());
+    header.name_count = name_count;
+    header.text_size = uint32_t(text.size());
+
+    std::string image(sizeof(AstFileHeader), '\0');
+    auto section = [&](void const* data, size_t bytes) {
+        image.resize((image.size() + 7) & ~size_t(7));
+        auto offset = uint32_t(image.size());
+        image.append(static_cast<const char*>(data), bytes);
+        return offset;
+    };
+    header.kinds = section(ast.kinds.data(), ast.kinds.size());
+    header.flags = section(ast.flags.data(), ast.flags.size());
+    header.first_child = section(ast.first_child.data(), ast.first_child.size() * sizeof(uint32_t));
+    header.next_sibling = section(ast.next_sibling.data(), ast.next_sibling.size() * sizeof(uint32_t));
+    header.offsets = section(ast.offsets.data(), ast.offsets.size() * sizeof(uint32_t));
+    header.payloads = section(ast.payloads.data(), ast.payloads.size() * sizeof(uint32_t));
+    header.symbols = section(symbols.data(), symbols.size() * sizeof(uint32_t));
+    header.numbers = section(ast.numbers.data(), ast.numbers.size() * sizeof(uint64_t));
+    header.strings = section(strings.data(), strings.size() * sizeof(uint32_t));
+    header.table = section(table_entries.data(), table_entries.size() * sizeof(AstFileString));
+    header.text = section(text.data(), text.size());
+    header.size = uint32_t(image.size());
+    std::memcpy(&image[0], &header, sizeof(header));
+    return image;
+}
+
+bool WriteAstFile(FlatAst const& ast, std::string const& path) {
+    auto image = SerializeAst(ast);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), std::streamsize(image.size()));
+    return bool(out);
+}
+
+// A flat AST read from an image in place. Has the columns and accessors of a
+// FlatAst, so WalkFlat, print_ast and visit work on it unchanged, but the
+// columns are pointers into the image instead of vectors.
+class MappedAst {
+public:
+    static constexpr uint32_t none = FlatAst::none;
+
+    MappedAst() = default;
+    MappedAst(MappedAst const&) = delete;
+    MappedAst& operator=(MappedAst const&) = delete;
+    ~MappedAst() { Close(); }
+
+    // Maps the image in the file at path
+    bool Load(std::string const& path);
+    // Uses the image at data, which must be 8-byte aligned and outlive this
+    bool Attach(const char* data, size_t size);
+
+    uint8_t const* kinds = nullptr;
+    uint8_t const* flags = nullptr;
+    uint32_t const* first_child = nullptr;
+    uint32_t const* next_sibling = nullptr;
+    uint32_t const* offsets = nullptr;
+    uint32_t const* payloads = nullptr;
+
+    size_t size() const { return m_node_count; }
+
+    Symbol Name(uint32_t node) const { return m_names[m_symbols[payloads[node]]]; }
+    uint64_t Number(uint32_t node) const { return m_numbers[payloads[node]]; }
+    std::string_view String(uint32_t node) const { return TableString(m_strings[payloads[node]]); }
+
+    uint32_t End(uint32_t node, uint32_t parent_end) const {
+        return next_sibling[node] != none ? next_sibling[node] : parent_end;
+    }
+
+    //Bytes of the image
+    size_t Bytes() const { return m_size; }
+
+    std::string const& ErrorMessage() const { return m_error; }
+
+protected:
+    std::string_view TableString(uint32_t entry) const {
+        return std::string_view(m_text + m_table[entry].offset, m_table[entry].length);
+    }
+
+    bool Error(std::string const& error_string) { m_error = error_string; return false; }
+    // Checks every index stored in the image once, so the accessors need not
+    bool Validate(AstFileHeader const& header) const;
+    void Close();
+
+    uint32_t m_node_count = 0;
+    uint32_t const* m_symbols = nullptr;
+    uint64_t const* m_numbers = nullptr;
+    uint32_t const* m_strings = nullptr;
+    AstFileString const* m_table = nullptr;
+    const char* m_text = nullptr;
+    std::vector<Symbol> m_names;    //Interned names of the first entries of the table
+
+    const char* m_mapping = nullptr;
+    size_t m_mapped_size = 0;
+    std::unique_ptr<uint64_t[]> m_owned;    //Image read into memory without mmap
+    size_t m_size = 0;
+    std::string m_error;
+};
+
+void MappedAst::Close() {
+#ifdef ASTFILE_HAVE_MMAP
+    if(m_mapping)
+        munmap(const_cast<char*>(m_mapping), m_mapped_size);
+#endif
+    m_mapping = nullptr;
+    m_mapped_size = 0;
+    m_owned.reset();
+}
+
+bool MappedAst::Load(std::string const& path) {
+    Close();
+#ifdef ASTFILE_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return Error("Unable to open " + path);
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return Error("Not an AST file " + path);
+    }
+
+    auto size = size_t(st.st_size);
+    void* base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return Error("Unable to map " + path);
+    m_mapping = static_cast<const char*>(base);
+    m_mapped_size = size;
+    return Attach(m_mapping, size);
+#else
+    std::ifstream in(path, std::ios::binary);
+    if(!in)
+        return Error("Unable to open " + path);
+
+    std::stringstream contents;
+    contents << in.rdbuf();
+    auto image = contents.str();
+    m_owned.reset(new uint64_t[image.size() / 8 + 1]);
+    std::memcpy(m_owned.get(), image.data(), image.size());
+    return Attach(reinterpret_cast<const char*>(m_owned.get()), image.size());
+#endif
+}
+
+bool MappedAst::Attach(const char* data, size_t size) {
+    m_node_count = 0;
+    m_names.clear();
+
+    AstFileHeader header;
+    if(size < sizeof(header))
+        return Error("AST file truncated");
+    if(reinterpret_cast<uintptr_t>(data) % 8)
+        return Error("AST image not aligned");
+    std::memcpy(&header, data, sizeof(header));
+    if(std::memcmp(header.magic, "GCA", 4) != 0)
+        return Error("Not an AST file");
+    if(header.byte_order != ast_file_byte_order)
+        return Error("AST file of a different byte order");
+    if(header.version != ast_file_version || header.kind_count != F_KIND_COUNT)
+        return Error("AST file of a different version");
+    if(header.size != size)
+        return Error("AST file truncated");
+
+    //Every section has to lie within the image and be aligned for its type
+    bool valid = true;
+    auto section = [&](uint32_t offset, size_t count, size_t item) {
+        if(offset % 8 || offset < sizeof(header) || offset > size || count > (size - offset) / item)
+            valid = false;
+        return data + offset;
+    };
+    kinds = reinterpret_cast<uint8_t const*>(section(header.kinds, header.node_count, 1));
+    flags = reinterpret_cast<uint8_t const*>(section(header.flags, header.node_count, 1));
+    first_child = reinterpret_cast<uint32_t const*>(section(header.first_child, header.node_count, sizeof(uint32_t)));
+    next_sibling = reinterpret_cast<uint32_t const*>(section(header.next_sibling, header.node_count, sizeof(uint32_t)));
+    offsets = reinterpret_cast<uint32_t const*>(section(header.offsets, header.node_count, sizeof(uint32_t)));
+    payloads = reinterpret_cast<uint32_t const*>(section(header.payloads, header.node_count, sizeof(uint32_t)));
+    m_symbols = reinterpret_cast<uint32_t const*>(section(header.symbols, header.symbol_count, sizeof(uint32_t)));
+    m_numbers = reinterpret_cast<uint64_t const*>(section(header.numbers, header.number_count, sizeof(uint64_t)));
+    m_strings = reinterpret_cast<uint32_t const*>(section(header.strings, header.string_count, sizeof(uint32_t)));
+    m_table = reinterpret_cast<AstFileString const*>(section(header.table, header.table_count, sizeof(AstFileString)));
+    m_text = section(header.text, header.text_size, 1);
+    if(!valid || header.name_count > header.table_count || !Validate(header))
+        return Error("AST file corrupt");
+
+    m_names.reserve(header.name_count);
+    for(uint32_t i = 0; i < header.name_count; ++i)
+        m_names.push_back(Symbol(TableString(i)));
+    m_node_count = header.node_count;
+    m_size = size;
+    return true;
+}
+
+bool MappedAst::Validate(AstFileHeader const& header) const {
+    for(uint32_t i = 0; i < header.table_count; ++i) {
+        if(m_table[i].offset > header.text_size || m_table[i].length > header.text_size - m_table[i].offset)
+            return false;
+    }
+    for(uint32_t i = 0; i < header.symbol_count; ++i) {
+        if(m_symbols[i] >= header.name_count)
+            return false;
+    }
+    for(uint32_t i = 0; i < header.string_count; ++i) {
+        if(m_strings[i] >= header.table_count)
+            return false;
+    }
+
+    //Links only point forward, since nodes are in pre-order
+    auto link = [&](uint32_t node, uint32_t target) {
+        return target == none || (target > node && target < header.node_count);
+    };
+    for(uint32_t i = 0; i < header.node_count; ++i) {
+        if(kinds[i] >= F_KIND_COUNT || !link(i, first_child[i]) || !link(i, next_sibling[i]))
+            return false;
+
+        //Size of the column the payload indexes into, see FlatAst
+        uint32_t count = UINT32_MAX;
+        switch(kinds[i]) {
+        case F_FILE: case F_STRING:
+            count = header.string_count; break;
+        case F_MODULE:
+            if(flags[i] & F_HAS_NAME)
+                count = header.symbol_count;
+            break;
+        case F_TYPE:
+            if(flags[i] & F_NAMED_TYPE)
+                count = header.symbol_count;
+            break;
+        case F_FUNCTION: case F_LET: case F_PARAMETER: case F_IDENTIFIER: case F_FN_CALL:
+            count = header.symbol_count; break;
+        case F_NUMBER:
+            count = header.number_count; break;
+        }
+        if(payloads[i] >= count)
+            return false;
+
+        //Functions and parameters are printed with the type in their first child
+        if((kinds[i] == F_FUNCTION || kinds[i] == F_PARAMETER)
+                && (first_child[i] == none || kinds[first_child[i]] != F_TYPE))
+            return false;
+    }
+    return true;
+}
+
+void print_ast(MappedAst const& ast) { print_flat(ast); }
+
+typedef BasicFlatNode<MappedAst> MappedNode;
+
+// Calls fn for every node of the image, in the order of the table
+template<typename T> void visit(MappedAst const& ast, T fn) {
+    for(uint32_t i = 0; i < ast.size(); ++i)
+        fn(MappedNode{&ast, i});
+}
+
+#endif //__astfile_h__
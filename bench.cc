@@ -0,0 +1,621 @@
+// Lexer and parser benchmarks, configure with -DCMAKE_BUILD_TYPE=Release.
+// Usage: gc_bench [name-filter]
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <functional>
+#include <tuple>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <initializer_list>
+#include <boost/variant.hpp>
+#include <boost/mpl/contains.hpp>
+#include <boost/optional.hpp>
+#include <boost/hana.hpp>
+
+#include "scan.hh"
+#include "interner.hh"
+#include "source.hh"
+#include "diagnostics.hh"
+#include "lexer.hh"
+#include "streamlexer.hh"
+#include "dfa.hh"
+#include "arena.hh"
+#include "parser.hh"
+#include "flat.hh"
+#include "astfile.hh"
+#include "symboltable.hh"
+
+#ifdef SCAN_HAVE_X86
+#include <x86intrin.h>
+#endif
+
+const char* bench_filter = nullptr;
+
+// Every heap allocation of the process is counted, so benchmarks can report
+// how much memory a run took besides its speed
+std::atomic<size_t> heap_allocations(0);
+std::atomic<size_t> heap_bytes(0);
+
+// Every form of new and delete is replaced, so all of them allocate with
+// malloc and free with free. They are kept out of line, or the compiler
+// sees malloc on one side and delete on the other after inlining and warns.
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+void* CountedAlloc(size_t size, size_t alignment) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    size = size ? size : 1;
+    void* p = alignment <= alignof(std::max_align_t) ? std::malloc(size)
+                                                     : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if(p)
+        return p;
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void* operator new(size_t size) { return CountedAlloc(size, 0); }
+BENCH_NOINLINE void* operator new[](size_t size) { return CountedAlloc(size, 0); }
+BENCH_NOINLINE void* operator new(size_t size, std::align_val_t alignment) { return CountedAlloc(size, size_t(alignment)); }
+BENCH_NOINLINE void* operator new[](size_t size, std::align_val_t alignment) { return CountedAlloc(size, size_t(alignment)); }
+
+BENCH_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete[](void* p) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete[](void* p, size_t) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+uint64_t Cycles() {
+#ifdef SCAN_HAVE_X86
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Runs fn until at least a quarter second has passed and reports the fastest
+// run. bytes is the amount of input handled by one call of fn.
+template<typename Fn>
+void Benchmark(std::string const& name, size_t bytes, Fn fn) {
+    if(bench_filter && name.find(bench_filter) == std::string::npos)
+        return;
+
+    using clock = std::chrono::steady_clock;
+    double best_seconds = 1e30;
+    uint64_t best_cycles = ~uint64_t(0);
+    auto start = clock::now();
+    int runs = 0;
+    while(runs < 3 || clock::now() - start < std::chrono::milliseconds(250)) {
+        auto t0 = clock::now();
+        uint64_t c0 = Cycles();
+        fn();
+        uint64_t c1 = Cycles();
+        auto t1 = clock::now();
+        best_seconds = std::min(best_seconds, std::chrono::duration<double>(t1 - t0).count());
+        best_cycles = std::min(best_cycles, c1 - c0);
+        runs++;
+    }
+
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(10) << std::fixed << std::setprecision(1) << bytes / best_seconds / 1e6 << " MB/s"
+              << std::setw(10) << std::setprecision(3) << double(bytes) / best_cycles << " bytes/cycle\n";
+}
+
+template<typename T>
+void DoNotOptimize(T const& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+const char* isa_names[] = {"scalar", "sse2", "avx2"};
+
+// Source that looks like generated code: a long license header, doc comment
+// blocks in front of every function and a few line comments.
+std::string CommentHeavySource(size_t size) {
+    std::string header = "/*\n";
+    for(int i = 0; i < 40; ++i)
+        header += " * Licensed under the terms in LICENSE, see the file for the full text of the license.\n";
+    header += " */\n\n";
+
+    std::string src = header;
+    for(int i = 0; src.size() < size; ++i) {
+        src += "/**\n * Generated accessor " + std::to_string(i) + ".\n *\n"
+               " * Do not edit, this file is regenerated by the build.\n */\n"
+               "fn get" + std::to_string(i) + "(int a, int b) -> int {\n"
+               "    // keep in sync with the table\n"
+               "    let r = a * " + std::to_string(i) + " + b;\n"
+               "}\n\n";
+    }
+    return src;
+}
+
+// Nothing but comments and indentation, so lexing time is all ReadWhitespace
+std::string CommentOnlySource(size_t size) {
+    std::string src;
+    while(src.size() < size) {
+        src += "/*\n";
+        for(int i = 0; i < 20; ++i)
+            src += " * Licensed under the terms in LICENSE, see the file for the full text of the license.\n";
+        src += " */\n";
+        for(int i = 0; i < 10; ++i)
+            src += "                // generated, do not edit\n";
+    }
+    return src + "end";
+}
+
+void BenchWhitespace() {
+    auto comments = CommentOnlySource(8 << 20);
+    auto src = CommentHeavySource(8 << 20);
+
+    for(auto isa : {scan::Isa::Scalar, scan::Isa::Sse2, scan::Isa::Avx2}) {
+        if(!scan::Use(isa))
+            continue;
+        Benchmark(std::string("lex/comment-only/") + isa_names[int(isa)], comments.size(), [&] {
+            auto tokens = Tokenize(comments.c_str());
+            DoNotOptimize(tokens);
+        });
+        Benchmark(std::string("lex/comment-heavy/") + isa_names[int(isa)], src.size(), [&] {
+            auto tokens = Tokenize(src.c_str());
+            DoNotOptimize(tokens);
+        });
+    }
+    scan::Use(scan::Best());
+}
+
+// Dense operator soup, mostly single character punctuation with a few of the
+// two character ones mixed in
+std::string PunctuationSource(size_t size) {
+    std::string src;
+    while(src.size() < size)
+        src += "f(a,b)->(c+d)*(e-g)/h;{x=y==z&&w;}.v;(((i)));\n";
+    return src;
+}
+
+void BenchPunctuation() {
+    auto src = PunctuationSource(8 << 20);
+    Benchmark("lex/punctuation-heavy", src.size(), [&] {
+        Lexer lex(src.c_str());
+        size_t count = 0;
+        while(lex.ReadToken())
+            count++;
+        DoNotOptimize(count);
+    });
+}
+
+// A large generated constant table
+std::string NumberSource(size_t size) {
+    std::string src;
+    for(uint64_t i = 0; src.size() < size; ++i)
+        src += std::to_string(i * 2654435761u % 1000000007) + ", ";
+    return src;
+}
+
+void BenchNumbers() {
+    auto src = NumberSource(8 << 20);
+    Benchmark("lex/number-heavy", src.size(), [&] {
+        Lexer lex(src.c_str());
+        uint64_t sum = 0;
+        while(auto token = lex.ReadToken())
+            sum+= lex.Int(*token);
+        DoNotOptimize(sum);
+    });
+}
+
+// Generated code with non-ASCII names, strings and doc comments
+std::string Utf8Source(size_t size) {
+    std::string src;
+    for(int i = 0; src.size() < size; ++i) {
+        src += "// Berechnet die Gr\xC3\xB6\xC3\x9F" "e f\xC3\xBCr \xCE\xBB-Ausdr\xC3\xBC" "cke\n"
+               "fn gr\xC3\xB6\xC3\x9F" "e" + std::to_string(i) + "(int \xCE\xB1, int \xCE\xB2) -> int {\n"
+               "    let \xC3\xA9t\xC3\xA9_" + std::to_string(i) + " = \xCE\xB1 * \xCE\xB2;\n"
+               "    let s = \"\xE2\x82\xAC " + std::to_string(i) + " \xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E \xF0\x9F\x98\x80\";\n"
+               "}\n";
+    }
+    return src;
+}
+
+void BenchUtf8() {
+    auto src = Utf8Source(8 << 20);
+
+    for(auto isa : {scan::Isa::Scalar, scan::Isa::Sse2, scan::Isa::Avx2}) {
+        if(!scan::Use(isa))
+            continue;
+        Benchmark(std::string("utf8/validate/") + isa_names[int(isa)], src.size(), [&] {
+            bool valid = scan::ValidUtf8(src.data(), src.size());
+            DoNotOptimize(valid);
+        });
+        Benchmark(std::string("lex/utf8/") + isa_names[int(isa)], src.size(), [&] {
+            auto tokens = Tokenize(src.c_str());
+            DoNotOptimize(tokens);
+        });
+    }
+    scan::Use(scan::Best());
+}
+
+// Generated functions full of nested arithmetic, for the parser
+std::string ExpressionSource(size_t size) {
+    std::string src;
+    for(int i = 0; src.size() < size; ++i) {
+        auto n = std::to_string(i);
+        src += "fn calc" + n + "(int a, int b) -> int {\n"
+               "    let x = a * (b + " + n + ") - (a / (b - 1)) * 7;\n"
+               "    let y = ((((a + 1) * 2) + 3) * 4) + x;\n"
+               "    let z = x + y * scale() - (((x)));\n"
+               "}\n";
+    }
+    return src;
+}
+
+// Parses a large pre-lexed program, and reports the heap allocations and the
+// arena memory of one parse
+void BenchParse() {
+    auto src = ExpressionSource(8 << 20);
+    auto tokens = Tokenize(src.c_str());
+
+    Benchmark("parse/large-program", src.size(), [&] {
+        AstArena arena;
+        Parser parser(tokens, nullptr, &arena);
+        auto ast = parser.Parse();
+        DoNotOptimize(ast);
+    });
+
+    if(bench_filter && std::string("parse/large-program").find(bench_filter) == std::string::npos)
+        return;
+    size_t allocations = heap_allocations;
+    size_t bytes = heap_bytes;
+    AstArena arena;
+    Parser parser(tokens, nullptr, &arena);
+    auto ast = parser.Parse();
+    DoNotOptimize(ast);
+    std::cout << "parse/large-program: " << heap_allocations - allocations << " heap allocations, "
+              << (heap_bytes - bytes) / 1e6 << " MB heap, " << arena.BytesUsed() / 1e6 << " MB arena for "
+              << src.size() / 1e6 << " MB of source\n";
+}
+
+// Parsing only the declarations of a program, then the bodies of a few
+// functions on demand
+void BenchLazy() {
+    auto src = ExpressionSource(8 << 20);
+    auto tokens = Tokenize(src.c_str());
+
+    Benchmark("parse/lazy/declarations", src.size(), [&] {
+        AstArena arena;
+        Parser parser(tokens, nullptr, &arena);
+        parser.SetLazyBodies(true);
+        auto ast = parser.Parse();
+        SymbolTable sym(*ast);
+        sym.GenerateDeclarations();
+        DoNotOptimize(sym.m_symbols);
+    });
+    Benchmark("parse/lazy/eager", src.size(), [&] {
+        AstArena arena;
+        Parser parser(tokens, nullptr, &arena);
+        auto ast = parser.Parse();
+        SymbolTable sym(*ast);
+        sym.GenerateDeclarations();
+        DoNotOptimize(sym.m_symbols);
+    });
+    Benchmark("parse/lazy/ten-bodies", src.size(), [&] {
+        AstArena arena;
+        Parser parser(tokens, nullptr, &arena);
+        parser.SetLazyBodies(true);
+        auto ast = parser.Parse();
+        auto const& functions = boost::get<FileNode>(*ast).modules[0].functions;
+        for(size_t i = 0; i < functions.size(); i+= functions.size() / 10)
+            DoNotOptimize(boost::get<FunctionNode>(functions[i]).Body());
+    });
+}
+
+// The large program with every function broken once, so the parser reports
+// and recovers from an error per function
+void BenchRecovery() {
+    auto src = ExpressionSource(8 << 20);
+    for(size_t pos = src.find("b + "); pos != std::string::npos; pos = src.find("b + ", pos))
+        src.replace(pos, 4, "b ; ");
+    auto tokens = Tokenize(src.c_str());
+
+    Benchmark("parse/recovery", src.size(), [&] {
+        AstArena arena;
+        Diagnostics diagnostics;
+        Parser parser(tokens, &diagnostics, &arena);
+        auto ast = parser.Parse();
+        DoNotOptimize(ast);
+        DoNotOptimize(diagnostics);
+    });
+}
+
+// Parsing with the repeated expressions of the large program shared, and the
+// arena memory that saves
+void BenchHashConsing() {
+    auto src = ExpressionSource(8 << 20);
+    auto tokens = Tokenize(src.c_str());
+
+    Benchmark("parse/hash-consing", src.size(), [&] {
+        AstArena arena;
+        Parser parser(tokens, nullptr, &arena);
+        parser.SetHashConsing(true);
+        auto ast = parser.Parse();
+        DoNotOptimize(ast);
+    });
+
+    if(bench_filter && std::string("parse/hash-consing").find(bench_filter) == std::string::npos)
+        return;
+    AstArena plain_arena, consed_arena;
+    Parser plain(tokens, nullptr, &plain_arena), consed(tokens, nullptr, &consed_arena);
+    consed.SetHashConsing(true);
+    DoNotOptimize(plain.Parse());
+    DoNotOptimize(consed.Parse());
+    std::cout << "parse/hash-consing: " << consed_arena.BytesUsed() / 1e6 << " MB arena vs "
+              << plain_arena.BytesUsed() / 1e6 << " MB without\n";
+}
+
+// Functions made of one let whose expression nests depth parentheses deep
+std::string NestedSource(size_t size, int depth) {
+    std::string expr = std::string(depth, '(') + "a";
+    for(int i = 0; i < depth; ++i)
+        expr += " + " + std::to_string(i) + ")";
+
+    std::string src;
+    for(int i = 0; src.size() < size; ++i)
+        src += "fn nest" + std::to_string(i) + "(int a) -> int {\n    let x = " + expr + ";\n}\n";
+    return src;
+}
+
+// Parse throughput should not depend on the size of the program nor on how
+// deep its expressions nest. A parser that copies subtrees on the way up
+// slows down with both.
+void BenchParseScaling() {
+    for(size_t mb : {1, 4, 16}) {
+        auto src = ExpressionSource(mb << 20);
+        auto tokens = Tokenize(src.c_str());
+        Benchmark("parse/scaling/size-" + std::to_string(mb) + "MB", src.size(), [&] {
+            AstArena arena;
+            Parser parser(tokens, nullptr, &arena);
+            auto ast = parser.Parse();
+            DoNotOptimize(ast);
+        });
+    }
+
+    for(int depth : {4, 32, 256}) {
+        auto src = NestedSource(4 << 20, depth);
+        auto tokens = Tokenize(src.c_str());
+        Benchmark("parse/scaling/depth-" + std::to_string(depth), src.size(), [&] {
+            AstArena arena;
+            Parser parser(tokens, nullptr, &arena);
+            auto ast = parser.Parse();
+            DoNotOptimize(ast);
+        });
+    }
+}
+
+// Flattening a parsed program, and the symbol table pass over the tree and
+// over the flat AST
+void BenchFlat() {
+    auto src = ExpressionSource(8 << 20);
+    auto tokens = Tokenize(src.c_str());
+    AstArena arena;
+    Parser parser(tokens, nullptr, &arena);
+    auto ast = parser.Parse().get();
+
+    Benchmark("ast/flatten", src.size(), [&] {
+        auto flat = Flatten(ast);
+        DoNotOptimize(flat);
+    });
+    Benchmark("ast/symbols/tree", src.size(), [&] {
+        SymbolTable sym(ast);
+        sym.Generate();
+        DoNotOptimize(sym.m_symbols);
+    });
+    auto flat = Flatten(ast);
+    Benchmark("ast/symbols/flat", src.size(), [&] {
+        SymbolTable sym(flat);
+        sym.Generate();
+        DoNotOptimize(sym.m_symbols);
+    });
+
+    if(bench_filter && std::string("ast/flatten").find(bench_filter) == std::string::npos)
+        return;
+    std::cout << "ast/flatten: " << flat.size() << " nodes, " << double(flat.Bytes()) / flat.size()
+              << " bytes per node, " << flat.Bytes() / 1e6 << " MB flat vs " << arena.BytesUsed() / 1e6 << " MB arena\n";
+}
+
+// Saving a flat AST, and getting it back from the file against lexing and
+// parsing the source again
+void BenchAstFile() {
+    auto src = ExpressionSource(8 << 20);
+    auto tokens = Tokenize(src.c_str());
+    AstArena arena;
+    auto flat = Flatten(Parser(tokens, nullptr, &arena).Parse().get());
+    const char* path = "gc_bench_ast.gca";
+    WriteAstFile(flat, path);
+
+    Benchmark("ast/file/serialize", src.size(), [&] {
+        auto image = SerializeAst(flat);
+        DoNotOptimize(image);
+    });
+    Benchmark("ast/file/reparse", src.size(), [&] {
+        auto tokens = Tokenize(src.c_str());
+        AstArena arena;
+        Parser parser(tokens, nullptr, &arena);
+        auto ast = Flatten(parser.Parse().get());
+        DoNotOptimize(ast);
+    });
+    Benchmark("ast/file/load", src.size(), [&] {
+        MappedAst mapped;
+        mapped.Load(path);
+        size_t lets = 0;
+        visit(mapped, [&](MappedNode node) { lets+= node.kind() == F_LET; });
+        DoNotOptimize(lets);
+    });
+    std::remove(path);
+
+    if(bench_filter && std::string("ast/file/serialize").find(bench_filter) == std::string::npos)
+        return;
+    std::cout << "ast/file: " << SerializeAst(flat).size() / 1e6 << " MB image vs " << flat.Bytes() / 1e6 << " MB flat\n";
+}
+
+// Building the line table for diagnostics, one newline scan over the buffer
+void BenchLineTable() {
+    auto src = CommentHeavySource(8 << 20);
+
+    for(auto isa : {scan::Isa::Scalar, scan::Isa::Sse2, scan::Isa::Avx2}) {
+        if(!scan::Use(isa))
+            continue;
+        Benchmark(std::string("lines/build/") + isa_names[int(isa)], src.size(), [&] {
+            LineTable lines(src.c_str());
+            DoNotOptimize(lines);
+        });
+    }
+    scan::Use(scan::Best());
+}
+
+// The generated DFA lexer against the hand-written one on each kind of input
+void BenchDfa() {
+    std::pair<const char*, std::string> sources[] = {
+        {"comment-heavy", CommentHeavySource(8 << 20)},
+        {"punctuation-heavy", PunctuationSource(8 << 20)},
+        {"number-heavy", NumberSource(8 << 20)},
+    };
+
+    for(auto const& source : sources) {
+        Benchmark(std::string("lex/dfa/") + source.first + "/hand-written", source.second.size(), [&] {
+            Lexer lex(source.second.c_str());
+            size_t count = 0;
+            while(lex.ReadToken())
+                count++;
+            DoNotOptimize(count);
+        });
+        Benchmark(std::string("lex/dfa/") + source.first + "/generated", source.second.size(), [&] {
+            DfaLexer lex(source.second.c_str());
+            size_t count = 0;
+            while(lex.ReadToken())
+                count++;
+            DoNotOptimize(count);
+        });
+    }
+}
+
+// One keystroke in the middle of a large file, relexing the edit against
+// lexing the whole file again
+void BenchRelex() {
+    auto src = CommentHeavySource(8 << 20);
+    auto tokens = Tokenize(src.c_str());
+    uint32_t middle = uint32_t(src.find("let r", src.size() / 2));
+
+    Benchmark("lex/relex/whole-file", src.size(), [&] {
+        auto fresh = Tokenize(src.c_str());
+        DoNotOptimize(fresh);
+    });
+    Benchmark("lex/relex/one-edit", src.size(), [&] {
+        //Type a character into a name and delete it again
+        src.insert(middle + 4, 1, 'x');
+        Relex(tokens, src.c_str(), TextEdit { middle + 4, 0, 1 });
+        src.erase(middle + 4, 1);
+        Relex(tokens, src.c_str(), TextEdit { middle + 4, 1, 0 });
+        DoNotOptimize(tokens);
+    });
+}
+
+// The streaming lexer fed in pipe sized blocks, against lexing the whole buffer
+void BenchStream() {
+    auto src = CommentHeavySource(8 << 20);
+    Benchmark("lex/stream/whole-buffer", src.size(), [&] {
+        Lexer lex(src.c_str());
+        size_t count = 0;
+        while(lex.ReadToken())
+            count++;
+        DoNotOptimize(count);
+    });
+    Benchmark("lex/stream/64k-blocks", src.size(), [&] {
+        size_t count = 0;
+        StreamLexer lex([&](Token const&, std::string_view, uint64_t) { count++; });
+        for(size_t i = 0; i < src.size(); i+= 64 * 1024)
+            lex.Feed(std::string_view(src).substr(i, 64 * 1024));
+        lex.Finish();
+        DoNotOptimize(count);
+    });
+}
+
+// Scaling of the parallel lexer on one large generated file
+void BenchParallel() {
+    auto src = CommentHeavySource(128 << 20);
+    Benchmark("lex/parallel/sequential", src.size(), [&] {
+        auto tokens = Tokenize(src.c_str());
+        DoNotOptimize(tokens);
+    });
+
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for(unsigned threads = 1; threads <= max_threads; threads*= 2) {
+        Benchmark("lex/parallel/" + std::to_string(threads), src.size(), [&] {
+            auto tokens = ParallelTokenize(src.c_str(), src.size(), threads);
+            DoNotOptimize(tokens);
+        });
+    }
+}
+
+// Parsing generated functions on several threads
+void BenchParallelParse() {
+    auto src = ExpressionSource(32 << 20);
+    auto tokens = Tokenize(src.c_str());
+    Benchmark("parse/parallel/sequential", src.size(), [&] {
+        AstArena arena;
+        Parser parser(tokens, nullptr, &arena);
+        auto ast = parser.ParseFile("");
+        DoNotOptimize(ast);
+    });
+
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for(unsigned threads = 1; threads <= max_threads; threads*= 2) {
+        Benchmark("parse/parallel/" + std::to_string(threads), src.size(), [&] {
+            AstArena arena;
+            Parser parser(tokens, nullptr, &arena);
+            auto ast = parser.ParallelParseFile("", threads);
+            DoNotOptimize(ast);
+        });
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1)
+        bench_filter = argv[1];
+
+    BenchWhitespace();
+    BenchPunctuation();
+    BenchNumbers();
+    BenchUtf8();
+    BenchLineTable();
+    BenchParse();
+    BenchParseScaling();
+    BenchLazy();
+    BenchRecovery();
+    BenchHashConsing();
+    BenchFlat();
+    BenchAstFile();
+    BenchDfa();
+    BenchRelex();
+    BenchStream();
+    BenchParallel();
+    BenchParallelParse();
+}
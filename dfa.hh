@@ -0,0 +1,359 @@
+#ifndef __dfa_h__
+#define __dfa_h__
+
+// A table driven lexer generated at compile time from a declarative token
+// specification.
+//
+// A rule is a sequence of character sets, each matched once or repeated zero
+// or more times. MakeSpec() lists the rules of the language: the punctuations
+// from punctuations[], names, the three kinds of number literals, strings,
+// whitespace and the openers of the two kinds of comments. MakeDfa() turns
+// them into a DFA with the subset construction: the bytes are first split
+// into the classes no rule tells apart, so the transition table has one
+// column per class and lexing costs one class lookup and one table lookup per
+// byte. Longest match wins, on a tie the rule listed first.
+//
+// Whitespace runs and comment bodies are skipped with the vector scanners
+// once the DFA has recognized how they start. Input the rules do not cover,
+// errors and number literals that may not be valid are handed to the
+// hand-written Lexer, so both produce the same tokens and errors.
+
+namespace dfa {
+
+struct CharSet {
+    uint64_t bits[4] = {};
+
+    constexpr bool Contains(unsigned char c) const { return (bits[c / 64] >> (c % 64)) & 1; }
+    constexpr void Add(unsigned char c) { bits[c / 64] |= uint64_t(1) << (c % 64); }
+};
+
+constexpr CharSet Chars(const char* chars) {
+    CharSet set;
+    for(; *chars; ++chars)
+        set.Add(static_cast<unsigned char>(*chars));
+    return set;
+}
+
+constexpr CharSet Range(char first, char last) {
+    CharSet set;
+    for(int c = first; c <= last; ++c)
+        set.Add(static_cast<unsigned char>(c));
+    return set;
+}
+
+constexpr CharSet operator|(CharSet lhs, CharSet rhs) {
+    for(int i = 0; i < 4; ++i)
+        lhs.bits[i] |= rhs.bits[i];
+    return lhs;
+}
+
+constexpr CharSet operator~(CharSet set) {
+    for(int i = 0; i < 4; ++i)
+        set.bits[i] = ~set.bits[i];
+    return set;
+}
+
+struct Element {
+    CharSet set;
+    bool repeat = false;    //Zero or more instead of exactly one
+};
+
+constexpr Element One(CharSet set) { return Element { set, false }; }
+constexpr Element Many(CharSet set) { return Element { set, true }; }
+
+enum class Action : uint8_t {
+    Token,
+    Space,
+    LineComment,
+    BlockComment
+};
+
+constexpr int max_elements = 4;
+constexpr int max_rules = 32;
+
+struct Rule {
+    Action action = Action::Token;
+    uint8_t kind = 0;
+    uint8_t id = P_NIL;
+    int count = 0;
+    Element elements[max_elements] = {};
+};
+
+struct Spec {
+    Rule rules[max_rules] = {};
+    int count = 0;
+
+    constexpr void Add(Action action, uint8_t kind, uint8_t id, std::initializer_list<Element> elements) {
+        if(count == max_rules)
+            throw "Too many lexer rules";
+        if(elements.size() > max_elements)
+            throw "Too many elements in a lexer rule";
+
+        auto& rule = rules[count++];
+        rule.action = action;
+        rule.kind = kind;
+        rule.id = id;
+        for(auto const& element : elements)
+            rule.elements[rule.count++] = element;
+    }
+};
+
+constexpr Spec MakeSpec() {
+    constexpr CharSet letters = Range('a', 'z') | Range('A', 'Z') | Chars("_") | Range(char(0x80), char(0xff));
+    constexpr CharSet digits = Range('0', '9');
+    constexpr CharSet hex_digits = digits | Range('a', 'f') | Range('A', 'F');
+
+    Spec spec;
+    for(int i = 0; punctuations[i].chars; ++i) {
+        spec.Add(Action::Token, T_PUNCTUATION, uint8_t(punctuations[i].id), {});
+        auto& rule = spec.rules[spec.count - 1];
+        for(const char* c = punctuations[i].chars; *c; ++c) {
+            if(rule.count == max_elements)
+                throw "Punctuation too long for a lexer rule";
+            CharSet set;
+            set.Add(static_cast<unsigned char>(*c));
+            rule.elements[rule.count++] = One(set);
+        }
+    }
+
+    spec.Add(Action::Token, T_NAME, P_NIL, {One(letters), Many(letters | digits)});
+    spec.Add(Action::Token, T_NUMBER, P_NIL, {One(digits), Many(digits)});
+    spec.Add(Action::Token, T_NUMBER, P_NIL, {One(Chars("0")), One(Chars("xX")), Many(hex_digits)});
+    spec.Add(Action::Token, T_NUMBER, P_NIL, {One(Chars("0")), One(Chars("bB")), Many(Chars("01"))});
+    spec.Add(Action::Token, T_STRING, P_NIL, {One(Chars("\"")), Many(~(Chars("\"\n") | Range('\0', '\0'))), One(Chars("\""))});
+    spec.Add(Action::Space, 0, P_NIL, {One(Chars(" \t\n"))});
+    spec.Add(Action::LineComment, 0, P_NIL, {One(Chars("/")), One(Chars("/"))});
+    spec.Add(Action::BlockComment, 0, P_NIL, {One(Chars("/")), One(Chars("*"))});
+    return spec;
+}
+
+constexpr int max_positions = 128;
+constexpr int max_states = 64;
+constexpr int max_classes = 32;
+constexpr uint8_t dead_state = 0;
+constexpr uint8_t start_state = 1;
+
+// A set of positions inside the rules, position base[r] + e is rule r having
+// matched its first e elements
+struct PositionSet {
+    uint64_t words[max_positions / 64] = {};
+
+    constexpr bool Contains(int p) const { return (words[p / 64] >> (p % 64)) & 1; }
+    constexpr void Add(int p) { words[p / 64] |= uint64_t(1) << (p % 64); }
+    constexpr bool operator==(PositionSet const& other) const {
+        for(int i = 0; i < max_positions / 64; ++i) {
+            if(words[i] != other.words[i])
+                return false;
+        }
+        return true;
+    }
+};
+
+struct Dfa {
+    uint8_t classes[256] = {};
+    uint8_t next[max_states][max_classes] = {};
+    int8_t accept[max_states] = {};     //Rule matched when the DFA stops here, -1 for none
+    Rule rules[max_rules] = {};
+    int state_count = 0;
+    int class_count = 0;
+};
+
+constexpr Dfa MakeDfa(Spec const& spec) {
+    Dfa dfa;
+    for(int r = 0; r < spec.count; ++r)
+        dfa.rules[r] = spec.rules[r];
+
+    //Split the bytes into classes, refining by every element's set
+    int class_count = 1;
+    for(int r = 0; r < spec.count; ++r) {
+        for(int e = 0; e < spec.rules[r].count; ++e) {
+            auto const& set = spec.rules[r].elements[e].set;
+            int split[max_classes][2] = {};
+            for(int c = 0; c < max_classes; ++c)
+                split[c][0] = split[c][1] = -1;
+
+            int count = 0;
+            for(int b = 0; b < 256; ++b) {
+                int& to = split[dfa.classes[b]][set.Contains(static_cast<unsigned char>(b))];
+                if(to < 0) {
+                    if(count == max_classes)
+                        throw "Too many character classes";
+                    to = count++;
+                }
+                dfa.classes[b] = static_cast<uint8_t>(to);
+            }
+            class_count = count;
+        }
+    }
+    dfa.class_count = class_count;
+
+    unsigned char representative[max_classes] = {};
+    for(int b = 255; b >= 0; --b)
+        representative[dfa.classes[b]] = static_cast<unsigned char>(b);
+
+    int base[max_rules + 1] = {};
+    for(int r = 0; r < spec.count; ++r)
+        base[r + 1] = base[r] + spec.rules[r].count + 1;
+    if(base[spec.count] > max_positions)
+        throw "Too many positions in the lexer rules";
+
+    //Repeated elements may match nothing, so a position before one implies the one after it
+    auto closure = [&](PositionSet set) {
+        for(int r = 0; r < spec.count; ++r) {
+            for(int e = 0; e < spec.rules[r].count; ++e) {
+                if(set.Contains(base[r] + e) && spec.rules[r].elements[e].repeat)
+                    set.Add(base[r] + e + 1);
+            }
+        }
+        return set;
+    };
+
+    PositionSet states[max_states] = {};
+    PositionSet start;
+    for(int r = 0; r < spec.count; ++r)
+        start.Add(base[r]);
+    states[start_state] = closure(start);
+    int state_count = 2;
+
+    for(int s = start_state; s < state_count; ++s) {
+        for(int c = 0; c < class_count; ++c) {
+            PositionSet moved;
+            bool any = false;
+            for(int r = 0; r < spec.count; ++r) {
+                for(int e = 0; e < spec.rules[r].count; ++e) {
+                    auto const& element = spec.rules[r].elements[e];
+                    if(!states[s].Contains(base[r] + e) || !element.set.Contains(representative[c]))
+                        continue;
+                    moved.Add(element.repeat ? base[r] + e : base[r] + e + 1);
+                    any = true;
+                }
+            }
+            if(!any)
+                continue;   //Stays dead_state
+
+            moved = closure(moved);
+            int target = start_state;
+            while(target < state_count && !(states[target] == moved))
+                target++;
+            if(target == state_count) {
+                if(state_count == max_states)
+                    throw "Too many lexer DFA states";
+                states[state_count++] = moved;
+            }
+            dfa.next[s][c] = static_cast<uint8_t>(target);
+        }
+    }
+    dfa.state_count = state_count;
+
+    for(int s = 0; s < state_count; ++s) {
+        dfa.accept[s] = -1;
+        for(int r = spec.count - 1; r >= 0; --r) {
+            if(states[s].Contains(base[r] + spec.rules[r].count))
+                dfa.accept[s] = static_cast<int8_t>(r);
+        }
+    }
+    return dfa;
+}
+
+constexpr Dfa lexer_dfa = MakeDfa(MakeSpec());
+
+} //namespace dfa
+
+// Lexer that recognizes tokens with dfa::lexer_dfa instead of the
+// hand-written Read* functions, producing the same tokens. It is built on a
+// Lexer for the buffer, the errors, the lookahead ring and the cases it hands
+// back, but cannot stand in for one; Tokenize takes either.
+class DfaLexer : private Lexer {
+public:
+    DfaLexer(const char* buffer, uint32_t offset = 0) : Lexer(buffer, offset) { }
+    DfaLexer(const char* buffer, uint32_t offset, size_t size) : Lexer(buffer, offset, size) { }
+
+    boost::optional<Token> ReadToken() { return ReadBuffered([this] { return LexDfaToken(); }); }
+    boost::optional<Token> PeekToken() {
+        auto token = Peek();
+        if(!token)
+            return boost::none;
+        return *token;
+    }
+    boost::optional<Token const&> Peek(size_t k = 0) { return PeekBuffered(k, [this] { return LexDfaToken(); }); }
+
+    using Lexer::Buffer;
+    using Lexer::Size;
+    using Lexer::Offset;
+    using Lexer::Text;
+    using Lexer::Str;
+    using Lexer::Int;
+    using Lexer::ErrorCode;
+    using Lexer::ErrorMessage;
+    using Lexer::ErrorOffset;
+    using Lexer::SetDiagnostics;
+    using Lexer::Silence;
+    using Lexer::lookahead_capacity;
+
+protected:
+    boost::optional<Token> LexDfaToken();
+};
+
+boost::optional<Token> DfaLexer::LexDfaToken() {
+    auto const& dfa = dfa::lexer_dfa;
+    for(;;) {
+        const char* start = m_current;
+        const char* p = start;
+        const char* accept_end = start;
+        int accept = -1;
+        for(uint8_t state = dfa::start_state;;) {
+            state = dfa.next[state][dfa.classes[static_cast<unsigned char>(*p)]];
+            if(state == dfa::dead_state)
+                break;
+            p++;
+            if(dfa.accept[state] >= 0) {
+                accept = dfa.accept[state];
+                accept_end = p;
+            }
+        }
+
+        if(accept < 0) {
+            if(*start == '\0')
+                return boost::none;
+            return LexToken();
+        }
+
+        auto const& rule = dfa.rules[accept];
+        switch(rule.action) {
+        case dfa::Action::Space:
+            m_current = scan::SkipSpace(accept_end, m_end);
+            continue;
+        case dfa::Action::LineComment:
+            m_current = scan::FindLineEnd(accept_end, m_end);
+            if(*m_current == '\0')
+                return boost::none;
+            continue;
+        case dfa::Action::BlockComment:
+            m_current = scan::SkipBlockComment(accept_end, m_end);
+            if(!m_current) {
+                m_current = start;
+                return boost::none;
+            }
+            continue;
+        case dfa::Action::Token:
+            break;
+        }
+
+        uint32_t length = uint32_t(accept_end - start);
+        if(rule.kind == T_NUMBER && (length > 18 || (length == 2 && start[0] == '0' && (start[1] < '0' || start[1] > '9'))))
+            return LexToken();   //May overflow or lack digits, let ReadNumber report it
+
+        //Names and strings with bytes above 0x7f must be valid UTF-8, let the Lexer report them if not
+        if((rule.kind == T_NAME || rule.kind == T_STRING) && !scan::ValidUtf8(start, length))
+            return LexToken();
+
+        m_current = accept_end;
+        if(rule.kind == T_NAME)
+            return MakeToken(T_NAME, P_NIL, start, interner().Intern(std::string_view(start, length)));
+        if(rule.kind == T_STRING)
+            return Token { T_STRING, P_NIL, uint32_t(start + 1 - m_buffer), length - 2 };
+        return MakeToken(rule.kind, rule.id, start);
+    }
+}
+
+#endif //__dfa_h__
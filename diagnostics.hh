@@ -0,0 +1,164 @@
+#ifndef __diagnostics_h__
+#define __diagnostics_h__
+
+// Errors and warnings of one compilation, collected instead of printed.
+//
+// The lexer and parser only append a Diagnostic: its code, the byte offset it
+// refers to and its arguments, kept as numbers, symbols or views of static or
+// source text. Nothing is formatted while compiling; the driver formats and
+// prints the whole list in one go once it is done, resolving offsets to lines
+// with the LineTable of the source only then.
+
+enum class Severity : uint8_t {
+    Note,
+    Warning,
+    Error
+};
+
+enum DiagnosticCode : uint16_t {
+    D_NONE = 0,
+    //Lexer
+    D_UNKNOWN_PUNCTUATION,
+    D_EOF_IN_STRING,
+    D_EOL_IN_STRING,
+    D_MISSING_DIGITS,
+    D_NUMBER_OVERFLOW,
+    D_INVALID_UTF8_NAME,
+    D_INVALID_UTF8_STRING,
+    //Parser
+    D_EXPECTED,
+    D_UNEXPECTED_EOF,
+    D_INVALID_TOKEN,
+    D_UNKNOWN_STATEMENT,
+    D_MODULE_EXISTS,
+    D_MODULE_UNSUPPORTED,
+
+    D_CODE_COUNT
+};
+
+struct DiagnosticInfo {
+    Severity severity;
+    const char* format;     //%0 to %9 are replaced by the arguments
+};
+
+const DiagnosticInfo diagnostic_infos[] = {
+    {Severity::Note, ""},
+    {Severity::Error, "Unknown punctuation"},
+    {Severity::Error, "End of file in string literal."},
+    {Severity::Error, "End of line in string literal."},
+    {Severity::Error, "Expected digits after number prefix"},
+    {Severity::Error, "Integer literal does not fit in 64 bits"},
+    {Severity::Error, "Invalid UTF-8 in name"},
+    {Severity::Error, "Invalid UTF-8 in string literal"},
+    {Severity::Error, "Parse error, expected %0"},
+    {Severity::Error, "Parse error, unexpected end of file in %0"},
+    {Severity::Error, "Parse error, invalid token in %0"},
+    {Severity::Error, "Parse error, unknown statement in code block"},
+    {Severity::Error, "Parse error, module %0 already exists"},
+    {Severity::Error, "Parse error, modules are not supported"}
+};
+
+static_assert(sizeof(diagnostic_infos) / sizeof(diagnostic_infos[0]) == D_CODE_COUNT, "diagnostic_infos[] out of sync with DiagnosticCode");
+
+// An argument of a diagnostic, a text argument must outlive the Diagnostics:
+// a string literal or a view of the source buffer
+struct DiagnosticArg {
+    enum Kind : uint8_t {
+        Number,
+        Name,
+        Text
+    };
+
+    Kind kind = Number;
+    uint64_t number = 0;
+    Symbol name;
+    std::string_view text;
+
+    DiagnosticArg(uint64_t value) : kind(Number), number(value) { }
+    DiagnosticArg(Symbol symbol) : kind(Name), name(symbol) { }
+    DiagnosticArg(std::string_view str) : kind(Text), text(str) { }
+    DiagnosticArg(const char* str) : kind(Text), text(str) { }
+};
+
+struct Diagnostic {
+    Severity severity;
+    uint16_t code;
+    uint32_t offset;
+    uint32_t first_arg;     //Index into Diagnostics::Args()
+    uint32_t arg_count;
+};
+
+class Diagnostics {
+public:
+    template<typename... Args>
+    void Report(DiagnosticCode code, uint32_t offset, Args const&... args) {
+        Diagnostic diagnostic { diagnostic_infos[code].severity, code, offset, uint32_t(m_args.size()), uint32_t(sizeof...(Args)) };
+        (m_args.emplace_back(args), ...);
+        m_diagnostics.push_back(diagnostic);
+        if(diagnostic.severity == Severity::Error)
+            m_error_count++;
+    }
+
+    std::vector<Diagnostic> const& List() const { return m_diagnostics; }
+    std::vector<DiagnosticArg> const& Args() const { return m_args; }
+    size_t size() const { return m_diagnostics.size(); }
+    size_t ErrorCount() const { return m_error_count; }
+    bool HasErrors() const { return m_error_count != 0; }
+
+    std::string Format(Diagnostic const& diagnostic) const;
+    // Writes every diagnostic on its own line, prefixed by file:line:column
+    // when the line table of the source is given
+    void Print(std::ostream& out, LineTable const* lines = nullptr, std::string_view file = "") const;
+
+    void Clear() { m_diagnostics.clear(); m_args.clear(); m_error_count = 0; }
+
+protected:
+    std::vector<Diagnostic> m_diagnostics;
+    std::vector<DiagnosticArg> m_args;
+    size_t m_error_count = 0;
+};
+
+std::string Diagnostics::Format(Diagnostic const& diagnostic) const {
+    std::string result;
+    for(const char* p = diagnostic_infos[diagnostic.code].format; *p; ++p) {
+        unsigned index = unsigned(p[1] - '0');
+        if(*p != '%' || index >= 10) {
+            result += *p;
+            continue;
+        }
+
+        p++;
+        if(index >= diagnostic.arg_count)
+            continue;
+        auto const& arg = m_args[diagnostic.first_arg + index];
+        switch(arg.kind) {
+        case DiagnosticArg::Number:
+            result += std::to_string(arg.number); break;
+        case DiagnosticArg::Name:
+            result += arg.name.view(); break;
+        case DiagnosticArg::Text:
+            result += arg.text; break;
+        }
+    }
+    return result;
+}
+
+void Diagnostics::Print(std::ostream& out, LineTable const* lines, std::string_view file) const {
+    const char* severities[] = {"note", "warning", "error"};
+
+    std::string text;
+    for(auto const& diagnostic : m_diagnostics) {
+        if(lines) {
+            auto location = lines->Resolve(diagnostic.offset);
+            text += file;
+            text += ":" + std::to_string(location.line) + ":" + std::to_string(location.column) + ": ";
+        }
+        text += severities[int(diagnostic.severity)];
+        text += ": ";
+        text += Format(diagnostic);
+        text += '\n';
+    }
+    out << text;
+}
+
+#endif //__diagnostics_h__
@@ -0,0 +1,334 @@
+#ifndef __flat_h__
+#define __flat_h__
+
+// The AST as one table of nodes instead of variants linked by pointers.
+//
+// Nodes are stored in pre-order, a parent before its children and a subtree
+// before its next sibling, column-wise: kind, flags, first child, next
+// sibling, source offset and a payload index. Names, numbers and strings sit
+// in side arrays the payload indexes into. A node takes 18 bytes plus its
+// side array entry, and a pass that only looks at some kinds of nodes can run
+// over the kind column from start to end.
+//
+// Kinds follow the order of the alternatives of AstVariant, so a kind is the
+// which() of the tree node it was made from.
+
+enum FlatKind : uint8_t {
+    F_FILE = 0,
+    F_MODULE,
+    F_FUNCTION,
+    F_BLOCK,
+    F_STATEMENT,
+    F_EMPTY_STATEMENT,
+    F_LET,
+    F_TYPE,
+    F_ADD,
+    F_DEC,
+    F_MUL,
+    F_DIV,
+    F_ASSIGN,
+    F_LOGIC_AND,
+    F_LOGIC_EQUAL,
+    F_NUMBER,
+    F_STRING,
+    F_IDENTIFIER,
+    F_FN_CALL,
+    F_PARAMETER,
+    F_ERROR,
+
+    F_KIND_COUNT
+};
+
+static_assert(boost::mpl::size<AstVariant::types>::value == F_KIND_COUNT, "FlatKind out of sync with AstVariant");
+
+enum FlatFlags : uint8_t {
+    F_MUT = 1 << 0,         //A let of a mutable variable
+    F_NAMED_TYPE = 1 << 1,  //A type whose payload is a name instead of a SimpleType
+    F_HAS_NAME = 1 << 2     //A module with a name
+};
+
+// Payload of each kind:
+//   F_FILE                                 index into strings, the file name
+//   F_MODULE                               index into symbols if F_HAS_NAME
+//   F_FUNCTION, F_LET, F_PARAMETER,
+//   F_IDENTIFIER, F_FN_CALL                index into symbols
+//   F_TYPE                                 SimpleType, or index into symbols with F_NAMED_TYPE
+//   F_NUMBER                               index into numbers
+//   F_STRING                               index into strings
+// Children of a function are its return type, its parameters and its body;
+// a parameter has its type as child. Nodes with no offset of their own take
+// the one of their first child, or 0 without children.
+struct FlatAst {
+    static constexpr uint32_t none = UINT32_MAX;
+
+    std::vector<uint8_t> kinds;
+    std::vector<uint8_t> flags;
+    std::vector<uint32_t> first_child;
+    std::vector<uint32_t> next_sibling;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> payloads;
+
+    std::vector<Symbol> symbols;
+    std::vector<uint64_t> numbers;
+    std::vector<std::string_view> strings;
+
+    size_t size() const { return kinds.size(); }
+
+    Symbol Name(uint32_t node) const { return symbols[payloads[node]]; }
+    uint64_t Number(uint32_t node) const { return numbers[payloads[node]]; }
+    std::string_view String(uint32_t node) const { return strings[payloads[node]]; }
+
+    // Index one past the last node of the subtree of node, given the end of
+    // the subtree of its parent
+    uint32_t End(uint32_t node, uint32_t parent_end) const {
+        return next_sibling[node] != none ? next_sibling[node] : parent_end;
+    }
+
+    //Bytes used by the node table and the side arrays
+    size_t Bytes() const {
+        return size() * (2 + 4 * sizeof(uint32_t)) + symbols.size() * sizeof(Symbol)
+             + numbers.size() * sizeof(uint64_t) + strings.size() * sizeof(std::string_view);
+    }
+};
+
+// Calls fn(ast, node, depth) for every node in order, depth counts from 0 at
+// the root. Keeps a stack of the subtree ends instead of recursing. Ast is a
+// FlatAst or anything with the same columns and accessors, like a MappedAst.
+template<typename Ast, typename Fn>
+void WalkFlat(Ast const& ast, Fn fn) {
+    std::vector<uint32_t> ends;
+    for(uint32_t i = 0; i < ast.size(); ++i) {
+        while(!ends.empty() && ends.back() <= i)
+            ends.pop_back();
+        fn(ast, i, int(ends.size()));
+        ends.push_back(ast.End(i, ends.empty() ? uint32_t(ast.size()) : ends.back()));
+    }
+}
+
+// Builds the flat form of a tree
+class Flattener : public boost::static_visitor<uint32_t> {
+public:
+    explicit Flattener(FlatAst& ast) : m_ast(ast) { }
+
+    uint32_t operator()(FileNode const& node) {
+        auto i = Add(F_FILE, FlatAst::none, String(node.name));
+        for(auto const& module : node.modules)
+            Child(i, (*this)(module));
+        return i;
+    }
+    uint32_t operator()(ModuleNode const& node) {
+        auto i = node.name ? Add(F_MODULE, FlatAst::none, Name(*node.name), F_HAS_NAME) : Add(F_MODULE, FlatAst::none, 0);
+        for(auto const& function : node.functions)
+            Child(i, boost::apply_visitor(*this, function));
+        return i;
+    }
+    uint32_t operator()(FunctionNode const& node) {
+        auto i = Add(F_FUNCTION, node.offset, Name(node.name));
+        Child(i, (*this)(node.return_type));
+        for(auto const& parameter : node.parameters)
+            Child(i, (*this)(parameter));
+        Child(i, (*this)(node.Body()));
+        return i;
+    }
+    uint32_t operator()(BlockNode const& node) {
+        auto i = Add(F_BLOCK, FlatAst::none, 0);
+        for(auto const& statement : node.statements)
+            Child(i, (*this)(statement));
+        return i;
+    }
+    uint32_t operator()(StatementNode const& node) { return Unary(F_STATEMENT, node.expr); }
+    uint32_t operator()(EmptyStatementNode const&) { return Add(F_EMPTY_STATEMENT, FlatAst::none, 0); }
+    uint32_t operator()(LetNode const& node) {
+        auto i = Add(F_LET, node.offset, Name(node.var_name), node.mut ? F_MUT : 0);
+        if(node.rhs)
+            Child(i, boost::apply_visitor(*this, *node.rhs));
+        return i;
+    }
+    uint32_t operator()(TypeNode const& node) {
+        return boost::apply_visitor(boost::hana::overload(
+            [&](SimpleType type) { return Add(F_TYPE, FlatAst::none, uint32_t(type)); },
+            [&](NamedType const& type) { return Add(F_TYPE, FlatAst::none, Name(type.name), F_NAMED_TYPE); }
+        ), node.type);
+    }
+    uint32_t operator()(AddNode const& node) { return Binary(F_ADD, node.lhs, node.rhs); }
+    uint32_t operator()(DecNode const& node) { return Binary(F_DEC, node.lhs, node.rhs); }
+    uint32_t operator()(MulNode const& node) { return Binary(F_MUL, node.lhs, node.rhs); }
+    uint32_t operator()(DivNode const& node) { return Binary(F_DIV, node.lhs, node.rhs); }
+    uint32_t operator()(AssignNode const& node) { return Binary(F_ASSIGN, node.lhs, node.rhs); }
+    uint32_t operator()(LogicAndNode const& node) { return Binary(F_LOGIC_AND, node.lhs, node.rhs); }
+    uint32_t operator()(LogicEqualNode const& node) { return Binary(F_LOGIC_EQUAL, node.lhs, node.rhs); }
+    uint32_t operator()(NumberNode const& node) {
+        m_ast.numbers.push_back(node.value);
+        return Add(F_NUMBER, node.offset, uint32_t(m_ast.numbers.size() - 1));
+    }
+    uint32_t operator()(StringNode const& node) { return Add(F_STRING, FlatAst::none, String(node.value)); }
+    uint32_t operator()(IdentifierNode const& node) { return Add(F_IDENTIFIER, node.offset, Name(node.identifier)); }
+    uint32_t operator()(FnCallNode const& node) { return Add(F_FN_CALL, node.offset, Name(node.identifier)); }
+    uint32_t operator()(ParameterNode const& node) {
+        auto i = Add(F_PARAMETER, node.offset, Name(node.name));
+        Child(i, (*this)(node.type));
+        return i;
+    }
+    uint32_t operator()(ErrorNode const& node) { return Add(F_ERROR, node.offset, 0); }
+
+protected:
+    uint32_t Add(uint8_t kind, uint32_t offset, uint32_t payload, uint8_t flags = 0) {
+        m_ast.kinds.push_back(kind);
+        m_ast.flags.push_back(flags);
+        m_ast.first_child.push_back(FlatAst::none);
+        m_ast.next_sibling.push_back(FlatAst::none);
+        m_ast.offsets.push_back(offset);
+        m_ast.payloads.push_back(payload);
+        m_last_child.push_back(FlatAst::none);
+        return uint32_t(m_ast.size() - 1);
+    }
+
+    void Child(uint32_t parent, uint32_t child) {
+        auto& last = m_last_child[parent];
+        if(last == FlatAst::none) {
+            m_ast.first_child[parent] = child;
+            if(m_ast.offsets[parent] == FlatAst::none)
+                m_ast.offsets[parent] = m_ast.offsets[child];
+        }
+        else
+            m_ast.next_sibling[last] = child;
+        last = child;
+    }
+
+    uint32_t Unary(uint8_t kind, AstNode const* operand) {
+        auto i = Add(kind, FlatAst::none, 0);
+        if(operand)
+            Child(i, boost::apply_visitor(*this, *operand));
+        return i;
+    }
+
+    uint32_t Binary(uint8_t kind, AstNode const* lhs, AstNode const* rhs) {
+        auto i = Add(kind, FlatAst::none, 0);
+        if(lhs)
+            Child(i, boost::apply_visitor(*this, *lhs));
+        if(rhs)
+            Child(i, boost::apply_visitor(*this, *rhs));
+        return i;
+    }
+
+    uint32_t Name(Symbol symbol) {
+        m_ast.symbols.push_back(symbol);
+        return uint32_t(m_ast.symbols.size() - 1);
+    }
+
+    uint32_t String(std::string_view str) {
+        m_ast.strings.push_back(str);
+        return uint32_t(m_ast.strings.size() - 1);
+    }
+
+    FlatAst& m_ast;
+    std::vector<uint32_t> m_last_child;
+};
+
+FlatAst Flatten(AstNode const& root) {
+    FlatAst ast;
+    Flattener flattener(ast);
+    boost::apply_visitor(flattener, root);
+    for(auto& offset : ast.offsets) {
+        if(offset == FlatAst::none)
+            offset = 0;
+    }
+    return ast;
+}
+
+template<typename Ast>
+void print_flat_type(Ast const& ast, uint32_t node) {
+    if(ast.flags[node] & F_NAMED_TYPE) {
+        std::cout << ast.Name(node);
+        return;
+    }
+    print_node(TypeNode{SimpleType(ast.payloads[node])}, 0);
+}
+
+// Prints the same text as print_ast does for the tree the flat AST was made
+// from, in one pass over the table
+template<typename Ast>
+void print_flat(Ast const& ast) {
+    const char* operations[] = {"AddNode\n", "DecNode\n", "MulNode\n", "DivNode\n", "Assign node\n", "LogicAnd node\n", "LogicEqual node\n"};
+
+    WalkFlat(ast, [&](Ast const& ast, uint32_t i, int depth) {
+        switch(ast.kinds[i]) {
+        case F_FILE:
+            tab(depth); std::cout << "File node\n"; break;
+        case F_MODULE:
+            if(ast.flags[i] & F_HAS_NAME)
+                std::cout << "Module node: " << ast.Name(i) << "\n";
+            else
+                std::cout << "Module node (global) \n";
+            break;
+        case F_FUNCTION:
+            tab(depth); std::cout << "Function node: " << ast.Name(i) << " return type ";
+            print_flat_type(ast, ast.first_child[i]);
+            std::cout << "\n";
+            break;
+        case F_PARAMETER:
+            tab(depth - 1); std::cout << "Param: ";
+            print_flat_type(ast, ast.first_child[i]);
+            std::cout << " " << ast.Name(i) << "\n";
+            break;
+        case F_TYPE:
+            break;  //Printed with its function or parameter
+        case F_BLOCK:
+            tab(depth); std::cout << "Block node: \n"; break;
+        case F_STATEMENT:
+            tab(depth); std::cout << "Statement\n"; break;
+        case F_EMPTY_STATEMENT:
+            tab(depth); std::cout << "Empty statement\n"; break;
+        case F_LET:
+            tab(depth); std::cout << "Let node " << ast.Name(i) << "\n"; break;
+        case F_ADD: case F_DEC: case F_MUL: case F_DIV: case F_ASSIGN: case F_LOGIC_AND: case F_LOGIC_EQUAL:
+            tab(depth); std::cout << operations[ast.kinds[i] - F_ADD]; break;
+        case F_NUMBER:
+            tab(depth); std::cout << "Number node value: " << ast.Number(i) << "\n"; break;
+        case F_STRING:
+            tab(depth); std::cout << "String node value " << ast.String(i) << "\n"; break;
+        case F_IDENTIFIER:
+            tab(depth); std::cout << "Identifier: " << ast.Name(i) << "\n"; break;
+        case F_FN_CALL:
+            tab(depth); std::cout << "Function call: " << ast.Name(i) << "\n"; break;
+        case F_ERROR:
+            tab(depth); std::cout << "Error node\n"; break;
+        }
+    });
+}
+
+void print_ast(FlatAst const& ast) { print_flat(ast); }
+
+// A node of a flat AST as handed to visitors
+template<typename Ast>
+struct BasicFlatNode {
+    Ast const* ast;
+    uint32_t index;
+
+    FlatKind kind() const { return FlatKind(ast->kinds[index]); }
+    uint8_t flags() const { return ast->flags[index]; }
+    uint32_t offset() const { return ast->offsets[index]; }
+    Symbol name() const { return ast->Name(index); }
+    uint64_t number() const { return ast->Number(index); }
+    std::string_view string() const { return ast->String(index); }
+
+    boost::optional<BasicFlatNode> first_child() const { return Link(ast->first_child[index]); }
+    boost::optional<BasicFlatNode> next_sibling() const { return Link(ast->next_sibling[index]); }
+
+protected:
+    boost::optional<BasicFlatNode> Link(uint32_t i) const {
+        if(i == FlatAst::none)
+            return boost::none;
+        return BasicFlatNode{ast, i};
+    }
+};
+
+typedef BasicFlatNode<FlatAst> FlatNode;
+
+// Calls fn for every node of the flat AST, in the order of the table
+template<typename T> void visit(FlatAst const& ast, T fn) {
+    for(uint32_t i = 0; i < ast.size(); ++i)
+        fn(FlatNode{&ast, i});
+}
+
+#endif //__flat_h__
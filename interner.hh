@@ -0,0 +1,155 @@
+#ifndef __interner_h__
+#define __interner_h__
+
+// Identifiers are interned once by the lexer and passed around the rest of the
+// pipeline as 32-bit Symbol ids, so comparing two names is an integer compare.
+// The keywords are interned first, in the order of the enum below, so a name
+// token is a keyword exactly when its symbol id is below S_KEYWORD_COUNT.
+
+enum Keywords : uint32_t {
+    S_NONE = 0,
+    //Reserved, not allowed as symbol names
+    S_FN,
+    S_MODULE,
+    S_IF,
+    S_LET,
+    S_RETURN,
+    S_VOID,
+    S_INT,
+    //Contextual, only special in certain places
+    S_MUT,
+    S_UINT,
+    S_CHAR,
+
+    S_KEYWORD_COUNT
+};
+
+const char* keywords[] = {
+    "",
+    "fn",
+    "module",
+    "if",
+    "let",
+    "return",
+    "void",
+    "int",
+    "mut",
+    "uint",
+    "char"
+};
+
+static_assert(sizeof(keywords) / sizeof(keywords[0]) == S_KEYWORD_COUNT, "keywords[] out of sync with Keywords");
+
+// Thread safe, lookups of strings that are already interned only take a
+// shared lock, or none when the name is in the per-thread cache.
+class Interner {
+public:
+    Interner() {
+        for(auto keyword : keywords)
+            Insert(keyword);
+    }
+
+    uint32_t Intern(std::string_view str) {
+        auto& cached = m_cache[std::hash<std::string_view>()(str) % cache_size];
+        if(cached.owner == this && cached.str == str)
+            return cached.id;
+
+        uint32_t id = Lookup(str);
+        cached = CacheEntry { this, Str(id), id };
+        return id;
+    }
+
+    //The id of str if it is interned already, S_NONE if not; never inserts
+    uint32_t Find(std::string_view str) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_ids.find(str);
+        return it != m_ids.end() ? it->second : uint32_t(S_NONE);
+    }
+
+    std::string_view Str(uint32_t id) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_strings[id];
+    }
+
+protected:
+    uint32_t Lookup(std::string_view str) {
+        {
+            std::shared_lock<std::shared_mutex> lock(m_mutex);
+            auto it = m_ids.find(str);
+            if(it != m_ids.end())
+                return it->second;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_ids.find(str);
+        if(it != m_ids.end())
+            return it->second;
+        return Insert(str);
+    }
+
+    uint32_t Insert(std::string_view str) {
+        uint32_t id = static_cast<uint32_t>(m_strings.size());
+        m_strings.emplace_back(str);
+        m_ids.emplace(m_strings.back(), id);
+        return id;
+    }
+
+    mutable std::shared_mutex m_mutex;
+    std::deque<std::string> m_strings; //Never moves its elements, m_ids points into them
+    std::unordered_map<std::string_view, uint32_t> m_ids;
+
+    // Recently interned names of the calling thread, so lexers running in
+    // parallel do not all contend for m_mutex on every name. The cached
+    // strings point into m_strings and stay valid.
+    struct CacheEntry {
+        Interner const* owner;
+        std::string_view str;
+        uint32_t id;
+    };
+    static constexpr size_t cache_size = 512;
+    static thread_local CacheEntry m_cache[cache_size];
+};
+
+thread_local Interner::CacheEntry Interner::m_cache[Interner::cache_size] = {};
+
+Interner& interner() {
+    static Interner instance;
+    return instance;
+}
+
+struct Symbol {
+    uint32_t id = S_NONE;
+
+    Symbol() = default;
+    explicit Symbol(uint32_t iid) : id(iid) { }
+    explicit Symbol(std::string_view str) : id(interner().Intern(str)) { }
+    explicit Symbol(std::string const& str) : id(interner().Intern(str)) { }
+    explicit Symbol(const char* str) : id(interner().Intern(str)) { }
+
+    //The symbol of str without interning it, Symbol() if it never was
+    static Symbol Find(std::string_view str) { return Symbol(interner().Find(str)); }
+
+    bool keyword() const { return id != S_NONE && id < S_KEYWORD_COUNT; }
+
+    std::string_view view() const { return interner().Str(id); }
+    std::string str() const { return std::string(view()); }
+};
+
+bool operator==(Symbol lhs, Symbol rhs) { return lhs.id == rhs.id; }
+bool operator!=(Symbol lhs, Symbol rhs) { return lhs.id != rhs.id; }
+bool operator<(Symbol lhs, Symbol rhs) { return lhs.id < rhs.id; }
+
+template <class CharType, class CharTrait>
+std::basic_ostream<CharType, CharTrait>&
+operator<<(std::basic_ostream<CharType, CharTrait>& out, Symbol symbol) {
+    out << symbol.view();
+    return out;
+}
+
+namespace std {
+template<> struct hash<Symbol> {
+    size_t operator()(Symbol symbol) const { return std::hash<uint32_t>()(symbol.id); }
+};
+}
+
+#endif //__interner_h__
@@ -25,7 +25,7 @@ enum PunctuationTypes : int {
     P_CLOSE_BRACE
 };
 
-Punctuation punctuations[] = {
+constexpr Punctuation punctuations[] = {
     {"==", P_LOGIC_EQUAL},
     {"&&", P_LOGIC_AND},
     {"->", P_RIGHT_ARROW},
@@ -45,6 +45,48 @@ Punctuation punctuations[] = {
     {nullptr, P_NIL}
 };
 
+// Punctuations grouped by their first character, longest first within each
+// group, so matching one costs a table lookup plus a few byte compares no
+// matter how many punctuations there are. Built from punctuations[] at
+// compile time.
+constexpr int max_punctuations_per_char = 4;
+
+struct PunctuationBucket {
+    uint8_t count = 0;
+    uint8_t length[max_punctuations_per_char] = {};
+    uint8_t index[max_punctuations_per_char] = {};
+};
+
+struct PunctuationTable {
+    PunctuationBucket buckets[256];
+};
+
+constexpr PunctuationTable MakePunctuationTable() {
+    PunctuationTable table;
+    for(int i = 0; punctuations[i].chars; ++i) {
+        const char* chars = punctuations[i].chars;
+        uint8_t len = 0;
+        while(chars[len])
+            len++;
+
+        auto& bucket = table.buckets[static_cast<unsigned char>(chars[0])];
+        if(bucket.count == max_punctuations_per_char)
+            throw "Too many punctuations share a first character";
+
+        //Insert keeping the bucket sorted longest first
+        int j = bucket.count++;
+        for(; j > 0 && bucket.length[j - 1] < len; --j) {
+            bucket.length[j] = bucket.length[j - 1];
+            bucket.index[j] = bucket.index[j - 1];
+        }
+        bucket.length[j] = len;
+        bucket.index[j] = static_cast<uint8_t>(i);
+    }
+    return table;
+}
+
+constexpr PunctuationTable punctuation_table = MakePunctuationTable();
+
 enum TokenTypes : int {
     T_STRING = 0,
     T_LITERAL,
@@ -53,96 +95,134 @@ enum TokenTypes : int {
     T_PUNCTUATION
 };
 
-struct StringToken {
-    StringToken(std::string idata) : data(idata) { }
-    std::string data;
-};
-
-struct LiteralToken {
-    LiteralToken(std::string idata) : data(idata) { }
-    std::string data;
+const char* token_type_names[] = {
+    "STRING",
+    "LITERAL",
+    "NAME",
+    "NUMBER",
+    "PUNCTUATION"
 };
 
-struct NameToken {
-    NameToken(std::string idata) : data(idata) { }
-    std::string data;
-};
+// Names start with a letter, '_' or any byte of a UTF-8 sequence and go on
+// with those and digits. The UTF-8 is validated over the whole name once it
+// has been scanned, and only if it has a byte above 0x7f.
+inline bool IsNameStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || static_cast<unsigned char>(c) >= 0x80;
+}
 
-struct NumberToken {
-    NumberToken(int idata) : data(idata) { }
-    int data;
-};
+inline bool IsNameChar(char c) {
+    return IsNameStart(c) || (c >= '0' && c <= '9');
+}
 
-struct PunctuationToken {
-    PunctuationToken(const char* idata, int i) : data(idata), id(i) { }
-    std::string data;
-    int id;
+// Number literals are decimal, or hexadecimal after 0x and binary after 0b,
+// and hold up to 64 bits. The value is accumulated while the digits are
+// scanned; on overflow the value saturates and overflow is set.
+struct NumberScan {
+    const char* end;
+    uint64_t value;
+    bool overflow;
+    bool missing_digits;
 };
 
-std::string type_as_str(const StringToken) {return "STRING";}
-std::string type_as_str(const LiteralToken) {return "LITERAL";}
-std::string type_as_str(const NumberToken) {return "NUMBER";}
-std::string type_as_str(const NameToken) {return "NAME";}
-std::string type_as_str(const PunctuationToken) {return "PUNCTUATION";}
-
-int type_as_int(const StringToken) {return T_STRING;}
-int type_as_int(const LiteralToken) {return T_LITERAL;}
-int type_as_int(const NumberToken) {return T_NUMBER;}
-int type_as_int(const NameToken) {return T_NAME;}
-int type_as_int(const PunctuationToken) {return T_PUNCTUATION;}
-
-std::string data_as_str(const StringToken tok) {return tok.data;}
-std::string data_as_str(const LiteralToken tok) {return tok.data;}
-std::string data_as_str(const NumberToken tok) {return std::to_string(tok.data);}
-std::string data_as_str(const NameToken tok) {return tok.data;}
-std::string data_as_str(const PunctuationToken tok) {return tok.data;}
-
-typedef boost::variant<StringToken, LiteralToken, NumberToken, NameToken, PunctuationToken> TokenData;
-
-struct Token {
-    int line;
-    TokenData data;
-
-    Token(int iline, TokenData idata) : line(iline), data(idata) { }
+inline int DigitValue(char c) {
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return 16;
+}
 
-    std::string type_str() {
-        auto my_visitor = boost::hana::overload([](auto token) -> std::string { return type_as_str(token); });
-        return boost::apply_visitor(my_visitor, data);
+NumberScan ScanNumber(const char* p) {
+    int base = 10;
+    if(p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p+= 2;
     }
-
-    int type() {
-        auto my_visitor = boost::hana::overload([](auto token) -> int { return type_as_int(token); });
-        return boost::apply_visitor(my_visitor, data);
+    else if(p[0] == '0' && (p[1] == 'b' || p[1] == 'B')) {
+        base = 2;
+        p+= 2;
     }
 
-    int subtype() {
-        auto my_visitor = boost::hana::overload_linearly(
-            [](PunctuationToken& token) -> int { return token.id; },
-            [](auto&) -> int {return P_NIL;}
-            );
-        return boost::apply_visitor(my_visitor, data);
+    //Largest value that can take another digit, and the largest digit it can take
+    const uint64_t cutoff = base == 10 ? UINT64_MAX / 10 : base == 16 ? UINT64_MAX / 16 : UINT64_MAX / 2;
+    const int cutlim = base == 10 ? UINT64_MAX % 10 : base == 16 ? UINT64_MAX % 16 : UINT64_MAX % 2;
+
+    const char* digits = p;
+    uint64_t value = 0;
+    bool overflow = false;
+    auto accumulate = [&](int digit) {
+        if(value > cutoff || (value == cutoff && digit > cutlim))
+            overflow = true;
+        else
+            value = value * base + digit;
+    };
+
+    if(base == 10) {
+        for(unsigned digit; (digit = unsigned(*p - '0')) < 10; ++p)
+            accumulate(digit);
     }
-
-    std::string data_str() {
-       auto my_visitor = boost::hana::overload([] (auto token) -> std::string {return data_as_str(token);});
-       return boost::apply_visitor(my_visitor, data);
+    else {
+        for(int digit; (digit = DigitValue(*p)) < base; ++p)
+            accumulate(digit);
     }
 
-    int data_int() {
-       auto my_visitor = boost::hana::overload_linearly(
-                   [] (NumberToken& token) -> int {return token.data;},
-                   [] (auto& ) -> int {return 0;}
-                );
-       return boost::apply_visitor(my_visitor, data);
+    return NumberScan { p, overflow ? UINT64_MAX : value, overflow, p == digits };
+}
+
+// A token is a plain value: its kind, punctuation id and the location of its
+// text in the buffer that was handed to the Lexer. Nothing is copied out of
+// the buffer, so the buffer must outlive the tokens; the text accessors take
+// the buffer (see Lexer::Text) and materialize owned strings only on request.
+// For string tokens the text excludes the surrounding quotes. Name tokens
+// carry their interned symbol id, keywords are the ids below S_KEYWORD_COUNT.
+// Lines are not tracked while lexing; resolve the offset with a LineTable.
+struct Token {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    uint32_t symbol = S_NONE;
+    uint8_t kind = T_NAME;
+    uint8_t id = P_NIL;
+
+    Token() = default;
+    Token(uint8_t ikind, uint8_t iid, uint32_t ioffset, uint32_t ilength, uint32_t isymbol = S_NONE)
+        : offset(ioffset), length(ilength), symbol(isymbol), kind(ikind), id(iid) { }
+
+    std::string type_str() const { return token_type_names[kind]; }
+    int type() const { return kind; }
+    int subtype() const { return id; }
+    Symbol name() const { return Symbol(symbol); }
+    uint32_t keyword() const { return symbol < S_KEYWORD_COUNT ? symbol : S_NONE; }
+
+    std::string_view data_view(const char* buffer) const { return std::string_view(buffer + offset, length); }
+    std::string data_str(const char* buffer) const { return std::string(data_view(buffer)); }
+
+    //The value of a number token is read back from its digits, a token is too small to hold it
+    uint64_t data_int(const char* buffer) const {
+        if(kind != T_NUMBER)
+            return 0;
+        return ScanNumber(buffer + offset).value;
     }
 };
 
+static_assert(std::is_trivially_copyable<Token>::value, "Token must stay a plain value");
+static_assert(sizeof(Token) <= 16, "Token should fit in 16 bytes");
+
 class Lexer {
 public:
-    Lexer(const char* buffer, int start_line = 0);
+    //Starts lexing at offset, token offsets are still relative to the start of buffer
+    Lexer(const char* buffer, uint32_t offset = 0);
+    //The same without looking for the end, buffer[size] is the NUL of the buffer
+    Lexer(const char* buffer, uint32_t offset, size_t size);
 
     boost::optional<Token> ReadToken();
     boost::optional<Token> PeekToken();
+    // Looks k tokens ahead without consuming them, Peek(0) is the token the
+    // next ReadToken returns. Up to lookahead_capacity tokens are buffered in
+    // a ring, k past that returns none. The reference stays valid until the
+    // token is read.
+    boost::optional<Token const&> Peek(size_t k = 0);
     bool ReadWhitespace();
     boost::optional<Token> ReadString();
     boost::optional<Token> ReadCharacter();
@@ -150,26 +230,81 @@ public:
     boost::optional<Token> ReadName();
     boost::optional<Token> ReadPunctuation();
 
-    void Error(const char* error_string) {m_error = error_string; m_error_line = m_line; std::cout << error_string << std::endl; }
+    const char* Buffer() const { return m_buffer; }
+    size_t Size() const { return size_t(m_end - m_buffer); }
+    uint32_t Offset() const { return uint32_t(m_current - m_buffer); }
+    std::string_view Text(Token const& token) const { return token.data_view(m_buffer); }
+    std::string Str(Token const& token) const { return token.data_str(m_buffer); }
+    uint64_t Int(Token const& token) const { return token.data_int(m_buffer); }
+
+    //The last error, its message is empty if there was none
+    DiagnosticCode ErrorCode() const { return m_error; }
+    std::string_view ErrorMessage() const { return diagnostic_infos[m_error].format; }
+    uint32_t ErrorOffset() const { return m_error_offset; }
+    void Error(DiagnosticCode code) {
+        m_error = code;
+        m_error_offset = Offset();
+        if(m_diagnostics && !m_silent)
+            m_diagnostics->Report(code, m_error_offset);
+    }
+    //Errors are reported to diagnostics as well as recorded, which must outlive the lexer
+    void SetDiagnostics(Diagnostics* diagnostics) { m_diagnostics = diagnostics; }
+    //Errors are still recorded but not reported
+    void Silence() { m_silent = true; }
+    static constexpr size_t lookahead_capacity = 8;
 protected:
+    boost::optional<Token> LexToken();
+    //ReadToken and Peek over the lookahead ring, lex() scans the next token
+    //of the buffer
+    template<typename Lex> boost::optional<Token> ReadBuffered(Lex lex);
+    template<typename Lex> boost::optional<Token const&> PeekBuffered(size_t k, Lex lex);
+
+    Token MakeToken(uint8_t kind, uint8_t id, const char* start, uint32_t symbol = S_NONE) const {
+        return Token { kind, id, uint32_t(start - m_buffer), uint32_t(m_current - start), symbol };
+    }
+
     const char* m_buffer;
     const char* m_current;
-    int m_line;
-
-    std::string m_error;
-    int m_error_line;
-    boost::optional<Token> m_peek = boost::none;
+    const char* m_end;      //The NUL at the end of the buffer, the scans never read past it
+
+    DiagnosticCode m_error = D_NONE;
+    uint32_t m_error_offset = 0;
+    Diagnostics* m_diagnostics = nullptr;
+    bool m_silent = false;
+
+    static_assert((lookahead_capacity & (lookahead_capacity - 1)) == 0, "Lookahead ring size must be a power of two");
+    Token m_lookahead[lookahead_capacity];
+    size_t m_lookahead_head = 0;
+    size_t m_lookahead_count = 0;
+    bool m_lookahead_stop = false;  //Lexing stopped right after the buffered tokens
 };
 
-Lexer::Lexer(const char* buffer, int start_line) : m_buffer(buffer), m_current(buffer), m_line(start_line) { }
+Lexer::Lexer(const char* buffer, uint32_t offset)
+    : m_buffer(buffer), m_current(buffer + offset), m_end(m_current + std::strlen(m_current)) { }
+
+Lexer::Lexer(const char* buffer, uint32_t offset, size_t size)
+    : m_buffer(buffer), m_current(buffer + offset), m_end(buffer + size) { }
 
 boost::optional<Token> Lexer::ReadToken() {
-    if(m_peek) {
-        auto ret = m_peek;
-        m_peek = boost::none;
-        return ret;
+    return ReadBuffered([this] { return LexToken(); });
+}
+
+template<typename Lex>
+boost::optional<Token> Lexer::ReadBuffered(Lex lex) {
+    if(m_lookahead_count) {
+        Token token = m_lookahead[m_lookahead_head];
+        m_lookahead_head = (m_lookahead_head + 1) & (lookahead_capacity - 1);
+        m_lookahead_count--;
+        return token;
+    }
+    if(m_lookahead_stop) {
+        m_lookahead_stop = false;
+        return boost::none;
     }
+    return lex();
+}
 
+boost::optional<Token> Lexer::LexToken() {
     if(!ReadWhitespace())
         return boost::none;
 
@@ -182,82 +317,76 @@ boost::optional<Token> Lexer::ReadToken() {
         result =ReadCharacter();
     else if(c >= '0' && c <= '9')
         result = ReadNumber();
-    else if( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || c == '_' )
+    else if(IsNameStart(c))
         result = ReadName();
     else {
         result = ReadPunctuation();
         if(!result)
-            Error("Unknown punctuation");
+            Error(D_UNKNOWN_PUNCTUATION);
     }
 
     return result;
 }
 
 boost::optional<Token> Lexer::PeekToken() {
-    if(m_peek)
-        return m_peek;
-    m_peek = ReadToken();
-    return m_peek;
+    auto token = Peek();
+    if(!token)
+        return boost::none;
+    return *token;
 }
 
-bool Lexer::ReadWhitespace() {
-    bool in_whitespace = true;
-    while(in_whitespace) {
-        if(*m_current == ' ' || *m_current == '\t')
-            m_current++;
-        //Skip comments
-        else if(*m_current == '/') {
-            if(*(m_current+1) == '/') { // skip double-slash // comments
-                m_current++;
-                do {
-                    m_current++;
-                    if(*m_current == '\0')
-                        return false; //Reached end of stream inside comment
-                } while(*m_current != '\n');
-
-                m_line++;
-            }
-            if(*(m_current+1) == '*') { // skip c-style block comments /* ... */
-                m_current++;
-
-                bool in_comment = true;
-                while(in_comment) {
-                    m_current++;
-                    if(*m_current == '\0')
-                        return false; //Reached end of stream inside block comment
-                    if(*m_current == '\n')
-                        m_line++;
-                    else if(*m_current == '/') {
-                        if(*(m_current-1) == '*')
-                            in_comment = false;
-                    }
-                }
-				m_current++;
-            }
-            else
-                in_whitespace = false;
-        }
-        else if(*m_current == '\n') {
-            m_line++;
-            m_current++;
-        }
-        else {
-            if(*m_current == '\0')
-                return false;
+boost::optional<Token const&> Lexer::Peek(size_t k) {
+    return PeekBuffered(k, [this] { return LexToken(); });
+}
+
+template<typename Lex>
+boost::optional<Token const&> Lexer::PeekBuffered(size_t k, Lex lex) {
+    if(k >= lookahead_capacity)
+        return boost::none;
+
+    while(m_lookahead_count <= k) {
+        if(m_lookahead_stop)
+            return boost::none;
 
-            in_whitespace = false;
+        auto token = lex();
+        if(!token) {
+            m_lookahead_stop = true;
+            return boost::none;
         }
+        m_lookahead[(m_lookahead_head + m_lookahead_count) & (lookahead_capacity - 1)] = *token;
+        m_lookahead_count++;
     }
+    return boost::optional<Token const&>(m_lookahead[(m_lookahead_head + k) & (lookahead_capacity - 1)]);
+}
 
-    return true;
+bool Lexer::ReadWhitespace() {
+    for(;;) {
+        char c = *m_current;
+        if(scan::IsSpace(c))
+            m_current = scan::SkipSpace(m_current, m_end);
+        else if(c == '/' && m_current[1] == '/') { // skip double-slash // comments
+            m_current = scan::FindLineEnd(m_current + 2, m_end);
+            if(*m_current == '\0')
+                return false; //Reached end of stream inside comment
+        }
+        else if(c == '/' && m_current[1] == '*') { // skip c-style block comments /* ... */
+            auto end = scan::SkipBlockComment(m_current + 2, m_end);
+            if(!end)
+                return false; //Reached end of stream inside block comment
+            m_current = end;
+        }
+        else
+            return c != '\0';
+    }
 }
 
 boost::optional<Token> Lexer::ReadString() {
     bool in_string = true;
-    std::string value = "";
 
     //leading quote
     m_current++;
+    const char* start = m_current;
+    unsigned char high = 0;
 
     boost::optional<Token> result = boost::none;
     while(in_string ) {
@@ -265,19 +394,21 @@ boost::optional<Token> Lexer::ReadString() {
 
         if(c == '\"') { //Reached end of string
             in_string = false;
-            result = Token { m_line, StringToken(value) };
+            result = MakeToken(T_STRING, P_NIL, start);
             m_current++;
+            if((high & 0x80) && !scan::ValidUtf8(start, result->length))
+                Error(D_INVALID_UTF8_STRING);
         }
         else if(c == '\0') {
             in_string = false;
-            Error("End of file in string literal.");
+            Error(D_EOF_IN_STRING);
         }
         else if(c == '\n') {
             in_string = false;
-            Error("End of line in string literal.");
+            Error(D_EOL_IN_STRING);
         }
         else {
-            value+= c;
+            high |= static_cast<unsigned char>(c);
             m_current++;
         }
     }
@@ -288,88 +419,373 @@ boost::optional<Token> Lexer::ReadString() {
 boost::optional<Token> Lexer::ReadCharacter() {
     m_current++;
 
-    while(*m_current != '\'')
+    while(*m_current != '\'' && *m_current != '\0')
         m_current ++;
 
     return boost::none;
 }
 
 boost::optional<Token> Lexer::ReadNumber() {
-    bool in_number = true;
+    const char* start = m_current;
+    auto number = ScanNumber(m_current);
+    m_current = number.end;
+
+    if(number.missing_digits)
+        Error(D_MISSING_DIGITS);
+    else if(number.overflow)
+        Error(D_NUMBER_OVERFLOW);
+
+    return MakeToken(T_NUMBER, P_NIL, start);
+}
 
-    std::string value = "";
-    value+= *m_current;
+boost::optional<Token> Lexer::ReadName() {
+    const char* start = m_current;
+    unsigned char high = static_cast<unsigned char>(*m_current);
     m_current++;
 
-    boost::optional<Token> result = boost::none;
+    while(IsNameChar(*m_current)) {
+        high |= static_cast<unsigned char>(*m_current);
+        m_current++;
+    }
 
-    while(in_number) {
-        char c = *m_current;
+    std::string_view name(start, m_current - start);
+    if((high & 0x80) && !scan::ValidUtf8(name.data(), name.size()))
+        Error(D_INVALID_UTF8_NAME);
 
-        if(c >= '0' && c <= '9') {
-            value+= *m_current;
-            m_current++;
-        }
-        else {
-            in_number = false;
-            result = Token { m_line, NumberToken(std::stoi(value, nullptr, 10)) };
+    return MakeToken(T_NAME, P_NIL, start, interner().Intern(name));
+}
+
+boost::optional<Token> Lexer::ReadPunctuation() {
+    auto const& bucket = punctuation_table.buckets[static_cast<unsigned char>(*m_current)];
+
+    //Candidates are sorted longest first, the first character is known to match
+    for(int i = 0; i < bucket.count; ++i) {
+        const char* chars = punctuations[bucket.index[i]].chars;
+        int len = bucket.length[i];
+
+        int j = 1;
+        while(j < len && m_current[j] == chars[j])
+            j++;
+
+        if(j == len) {
+            const char* start = m_current;
+            m_current+= len;
+            return MakeToken(T_PUNCTUATION, punctuations[bucket.index[i]].id, start);
         }
     }
 
-    return result;
+    m_current++;
+    return boost::none;
 }
 
-boost::optional<Token> Lexer::ReadName() {
-    bool in_name = true;
+// Tokens of a whole buffer lexed up front, stored column-wise so the parser
+// can walk them sequentially with an index and look ahead arbitrarily far.
+struct TokenStream {
+    const char* buffer = nullptr;
+    size_t buffer_size = 0;     //Bytes before the NUL of buffer
+    std::vector<uint8_t> kinds;
+    std::vector<uint8_t> ids;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+    std::vector<uint32_t> symbols;
+
+    size_t size() const { return kinds.size(); }
+
+    Token operator[](size_t i) const {
+        return Token { kinds[i], ids[i], offsets[i], lengths[i], symbols[i] };
+    }
 
-    std::string value = "";
-    value+= *m_current;
+    std::string_view Text(size_t i) const { return std::string_view(buffer + offsets[i], lengths[i]); }
 
-    m_current++;
+    void reserve(size_t n) {
+        kinds.reserve(n); ids.reserve(n); offsets.reserve(n); lengths.reserve(n); symbols.reserve(n);
+    }
 
-    boost::optional<Token> result = boost::none;
+    void resize(size_t n) {
+        kinds.resize(n); ids.resize(n); offsets.resize(n); lengths.resize(n); symbols.resize(n);
+    }
+
+    void push_back(Token const& token) {
+        kinds.push_back(token.kind);
+        ids.push_back(token.id);
+        offsets.push_back(token.offset);
+        lengths.push_back(token.length);
+        symbols.push_back(token.symbol);
+    }
+};
 
-    while(in_name) {
-        char c= *m_current;
+// Reads every remaining token of the lexer into a TokenStream, LexerT is a
+// Lexer or a DfaLexer
+template<typename LexerT>
+TokenStream Tokenize(LexerT& lex) {
+    TokenStream tokens;
+    tokens.buffer = lex.Buffer();
+    tokens.buffer_size = lex.Size();
 
-        if(( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || c == '_') {
-            value+= c;
-            m_current++;
+    while(auto token = lex.ReadToken())
+        tokens.push_back(*token);
+
+    return tokens;
+}
+
+TokenStream Tokenize(const char* buffer, Diagnostics* diagnostics = nullptr) {
+    Lexer lex(buffer);
+    lex.SetDiagnostics(diagnostics);
+    return Tokenize(lex);
+}
+
+// An edit of a buffer: removed bytes at offset were replaced by inserted
+// bytes. offset is the same in the old and the new text.
+struct TextEdit {
+    uint32_t offset;
+    uint32_t removed;
+    uint32_t inserted;
+};
+
+// The tokens Relex replaced: removed tokens starting at index first made
+// room for inserted new ones
+struct TokenEdit {
+    size_t first;
+    size_t removed;
+    size_t inserted;
+};
+
+template<typename T>
+void Splice(std::vector<T>& column, size_t first, size_t removed, std::vector<T> const& inserted) {
+    if(inserted.size() > removed)
+        column.insert(column.begin() + first + removed, inserted.size() - removed, T());
+    else
+        column.erase(column.begin() + first + inserted.size(), column.begin() + first + removed);
+    std::copy(inserted.begin(), inserted.end(), column.begin() + first);
+}
+
+// Updates the tokens of a buffer after an edit, buffer is the edited text.
+// Lexing restarts after the last token that ends before the edit (the lexer
+// reads one character past a token, so a token touching the edit may change)
+// and stops as soon as a new token after the edited text starts where an old
+// token did: the lexer has no state besides its position, so from there on
+// the old tokens are still right and only get their offsets shifted. The
+// result is the same as Tokenize(buffer), at the cost of lexing the edited
+// region instead of the whole buffer. The size of the edited buffer follows
+// from tokens.buffer_size and the edit.
+TokenEdit Relex(TokenStream& tokens, const char* buffer, TextEdit const& edit) {
+    auto& offsets = tokens.offsets;
+    auto& lengths = tokens.lengths;
+
+    size_t first = std::upper_bound(offsets.begin(), offsets.end(), edit.offset) - offsets.begin();
+    while(first > 0 && offsets[first - 1] + lengths[first - 1] >= edit.offset)
+        first--;
+
+    uint32_t start = 0;
+    if(first > 0)
+        start = offsets[first - 1] + lengths[first - 1] + (tokens.kinds[first - 1] == T_STRING ? 1 : 0);
+
+    //Offsets of tokens after the edit move by inserted - removed, unsigned wrap around does the right thing
+    uint32_t edit_end = edit.offset + edit.inserted;
+    auto old_offset = [&](uint32_t offset) { return offset - edit.inserted + edit.removed; };
+
+    TokenStream fresh;
+    size_t resync = tokens.size();
+    size_t old = first;
+    size_t size = tokens.buffer_size + edit.inserted - edit.removed;
+    Lexer lex(buffer, start, size);
+    while(auto token = lex.ReadToken()) {
+        if(token->offset >= edit_end) {
+            uint32_t offset = old_offset(token->offset);
+            while(old < tokens.size() && offsets[old] < offset)
+                old++;
+            if(old < tokens.size() && offsets[old] == offset) {
+                resync = old;
+                break;
+            }
         }
-        else {
-            in_name = false;
-            result = Token { m_line, NameToken(value) };
+        fresh.push_back(*token);
+    }
+
+    size_t removed = resync - first;
+    Splice(tokens.kinds, first, removed, fresh.kinds);
+    Splice(tokens.ids, first, removed, fresh.ids);
+    Splice(tokens.offsets, first, removed, fresh.offsets);
+    Splice(tokens.lengths, first, removed, fresh.lengths);
+    Splice(tokens.symbols, first, removed, fresh.symbols);
+
+    for(size_t i = first + fresh.size(); i < offsets.size(); ++i)
+        offsets[i] = offsets[i] + edit.inserted - edit.removed;
+    tokens.buffer = buffer;
+    tokens.buffer_size = size;
+
+    return TokenEdit { first, removed, fresh.size() };
+}
+
+// Runs fn(i) for every i below count on up to threads threads
+template<typename Fn>
+void ParallelFor(size_t count, unsigned threads, Fn fn) {
+    std::atomic<size_t> next(0);
+    auto worker = [&] {
+        for(size_t i; (i = next++) < count;)
+            fn(i);
+    };
+
+    std::vector<std::thread> pool;
+    for(size_t i = 1; i < std::min<size_t>(threads, count); ++i)
+        pool.emplace_back(worker);
+    worker();
+    for(auto& thread : pool)
+        thread.join();
+}
+
+// A piece of a buffer lexed on its own by ParallelTokenize
+struct TokenChunk {
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    TokenStream tokens;
+    uint32_t resume = 0;    //Where the lexer stood after the last token, at or past end unless stopped
+    bool stopped = false;   //The lexer hit an error or the end of the buffer
+    struct Error {
+        uint32_t token;     //Start of the offending token
+        uint32_t offset;
+        DiagnosticCode code;
+    };
+    std::vector<Error> errors;
+};
+
+// Lexes the tokens that start below chunk.end, beginning at from as if the
+// lexer had got there on its own
+void LexChunk(const char* buffer, size_t size, TokenChunk& chunk, uint32_t from) {
+    Lexer lex(buffer, from, size);
+    lex.Silence();
+    chunk.tokens = TokenStream();
+    chunk.tokens.buffer = buffer;
+    chunk.tokens.buffer_size = size;
+    chunk.stopped = false;
+    chunk.errors.clear();
+
+    uint32_t error_offset = UINT32_MAX;
+    for(;;) {
+        chunk.stopped = !lex.ReadWhitespace();
+        chunk.resume = lex.Offset();
+        if(chunk.stopped || chunk.resume >= chunk.end)
+            return;
+
+        auto token = lex.ReadToken();
+        if(lex.ErrorCode() != D_NONE && lex.ErrorOffset() != error_offset) {
+            error_offset = lex.ErrorOffset();
+            chunk.errors.push_back(TokenChunk::Error { chunk.resume, error_offset, lex.ErrorCode() });
         }
+        if(!token) {
+            chunk.stopped = true;
+            return;
+        }
+        chunk.tokens.push_back(*token);
     }
-    return result;
 }
 
-boost::optional<Token> Lexer::ReadPunctuation() {
-    boost::optional<Token> result = boost::none;
-    
-    //Check against all punctuations, longest first
-    bool match = false;
-    for(int i = 0; punctuations[i].chars && !match; ++i) {
-        int len = strlen(punctuations[i].chars);
-
-        match = true;
-        for(int j = 0; j < len && match; ++j) {
-            if(m_current[j] == '\0')
-                match = false;
-            else if(m_current[j] != punctuations[i].chars[j])
-                match = false;
+// Picks a place to split the buffer at or after offset. Strings cannot span
+// lines, so any line start is outside a string literal; to stay out of block
+// comments as well a line that starts with code in the first column is
+// preferred, comment bodies are usually indented or start with " *". Returns
+// the first line start if none is found close by.
+uint32_t ChunkBoundary(const char* buffer, size_t size, size_t offset) {
+    const char* limit = buffer + std::min(size, offset + 64 * 1024);
+    const char* first = nullptr;
+    for(const char* p = buffer + offset; p < limit; ) {
+        p = scan::FindLineEnd(p, buffer + size);
+        if(*p == '\0')
+            break;
+        p++;
+        if(!first)
+            first = p;
+
+        char c = *p;
+        if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '}')
+            return uint32_t(p - buffer);
+    }
+    return first ? uint32_t(first - buffer) : uint32_t(size);
+}
+
+// Lexes a large buffer on several threads, with the same result as
+// Tokenize(buffer). The buffer is split into chunks of about chunk_size bytes
+// at line starts, every chunk is lexed by its own Lexer and the token arrays
+// are joined in order. A chunk is only used from the first token where its
+// lexer agrees with the end of the previous chunk; if a split still landed in
+// a block comment and the chunk never agrees, it is lexed again from there.
+// Errors are reported to diagnostics in source order after the chunks are
+// lexed.
+TokenStream ParallelTokenize(const char* buffer, size_t size, unsigned threads = 0, size_t chunk_size = 1 << 20,
+                             Diagnostics* diagnostics = nullptr) {
+    if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    size_t count = std::max<size_t>(1, size / std::max<size_t>(1, chunk_size));
+    std::vector<TokenChunk> chunks;
+    chunks.reserve(count);
+    uint32_t begin = 0;
+    for(size_t i = 1; i <= count && begin < size; ++i) {
+        uint32_t end = i == count ? uint32_t(size) : ChunkBoundary(buffer, size, i * size / count);
+        if(end <= begin)
+            continue;
+        chunks.emplace_back();
+        chunks.back().begin = begin;
+        chunks.back().end = end;
+        begin = end;
+    }
+
+    ParallelFor(chunks.size(), threads, [&](size_t i) {
+        LexChunk(buffer, size, chunks[i], chunks[i].begin);
+    });
+
+    //Find the part of every chunk the sequential lexer would have produced
+    struct Range {
+        size_t first = 0;
+        size_t last = 0;
+        size_t out = 0;
+    };
+    std::vector<Range> ranges(chunks.size());
+    size_t total = 0;
+    uint32_t expected = 0;
+    for(size_t i = 0; i < chunks.size(); ++i) {
+        auto& chunk = chunks[i];
+        if(expected >= chunk.end)
+            continue;   //Inside a comment that started in an earlier chunk
+
+        auto const& offsets = chunk.tokens.offsets;
+        size_t first = std::lower_bound(offsets.begin(), offsets.end(), expected) - offsets.begin();
+        bool in_sync = chunk.resume == expected || (first < offsets.size() && offsets[first] == expected);
+        if(!in_sync) {
+            LexChunk(buffer, size, chunk, expected);
+            first = 0;
         }
 
-        if(match) {
-            result = Token {m_line, PunctuationToken(punctuations[i].chars, punctuations[i].id)};
-            m_current+= len;
+        ranges[i] = Range { first, chunk.tokens.size(), total };
+        total+= chunk.tokens.size() - first;
+
+        for(auto const& error : chunk.errors) {
+            if(diagnostics && error.token >= expected)
+                diagnostics->Report(error.code, error.offset);
         }
+        if(chunk.stopped)
+            break;
+        expected = chunk.resume;
     }
 
-    if(!result)
-        m_current++;
-
-    return result;
+    TokenStream tokens;
+    tokens.buffer = buffer;
+    tokens.buffer_size = size;
+    tokens.resize(total);
+    ParallelFor(chunks.size(), threads, [&](size_t i) {
+        auto const& from = chunks[i].tokens;
+        auto range = ranges[i];
+        auto copy = [&](auto const& src, auto& dst) {
+            std::copy(src.begin() + range.first, src.begin() + range.last, dst.begin() + range.out);
+        };
+        copy(from.kinds, tokens.kinds);
+        copy(from.ids, tokens.ids);
+        copy(from.offsets, tokens.offsets);
+        copy(from.lengths, tokens.lengths);
+        copy(from.symbols, tokens.symbols);
+    });
+
+    return tokens;
 }
 
 #endif //__lexer_h__
\ No newline at end of file
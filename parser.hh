@@ -9,18 +9,20 @@ struct StatementNode;
 struct EmptyStatementNode;
 struct LetNode;
 struct TypeNode;
-struct ExprNode;
 struct AddNode;
 struct DecNode;
 struct MulNode;
 struct DivNode;
 struct AssignNode;
 struct LogicAndNode;
+struct LogicEqualNode;
 struct NumberNode;
 struct StringNode;
 struct IdentifierNode;
 struct FnCallNode;
 struct ParameterNode;
+struct ErrorNode;
+struct LazyBody;
 
 enum SimpleType {
     TYPE_INT=1,
@@ -30,7 +32,7 @@ enum SimpleType {
 };
 
 struct NamedType {
-    std::string name;
+    Symbol name;
 };
 
 bool operator==(NamedType const& lhs, NamedType const& rhs) {
@@ -39,253 +41,410 @@ bool operator==(NamedType const& lhs, NamedType const& rhs) {
     return false;
 }
 
-typedef boost::variant< boost::recursive_wrapper<FileNode>,
-                        boost::recursive_wrapper<ModuleNode>,
-                        boost::recursive_wrapper<FunctionNode>,
-                        boost::recursive_wrapper<BlockNode>,
-                        boost::recursive_wrapper<StatementNode>,
-                        boost::recursive_wrapper<EmptyStatementNode>,
-                        boost::recursive_wrapper<LetNode>,
-                        boost::recursive_wrapper<TypeNode>,
-                        boost::recursive_wrapper<ExprNode>,
-                        boost::recursive_wrapper<AddNode>,
-                        boost::recursive_wrapper<DecNode>,
-                        boost::recursive_wrapper<MulNode>,
-                        boost::recursive_wrapper<DivNode>,
-
-                        boost::recursive_wrapper<AssignNode>,
-                        boost::recursive_wrapper<LogicAndNode>,
-                        boost::recursive_wrapper<NumberNode>,
-                        boost::recursive_wrapper<StringNode>,
-    
-                        boost::recursive_wrapper<IdentifierNode>,
-                        boost::recursive_wrapper<FnCallNode>,
-                        boost::recursive_wrapper<ParameterNode>
-                        > AstNode;
+// Nodes are held by value in the variant and keep their children as pointers
+// and AstLists into the AstArena of the compilation, so copying a node is
+// shallow and the tree is freed with the arena.
+typedef boost::variant< FileNode,
+                        ModuleNode,
+                        FunctionNode,
+                        BlockNode,
+                        StatementNode,
+                        EmptyStatementNode,
+                        LetNode,
+                        TypeNode,
+                        AddNode,
+                        DecNode,
+                        MulNode,
+                        DivNode,
+
+                        AssignNode,
+                        LogicAndNode,
+                        LogicEqualNode,
+                        NumberNode,
+                        StringNode,
+
+                        IdentifierNode,
+                        FnCallNode,
+                        ParameterNode,
+                        ErrorNode
+                        > AstVariant;
+
+struct AstNode;
 
 using std::vector;
 using std::map;
-struct FileNode { std::string name; vector<ModuleNode> modules; };
-struct ModuleNode { boost::optional<std::string> name; vector<AstNode> functions;
-                    ModuleNode(std::string iname) : name(iname) {} ModuleNode() { } };
+struct FileNode { std::string_view name; AstList<ModuleNode> modules; };
+struct ModuleNode { boost::optional<Symbol> name; AstList<AstNode> functions;
+                    ModuleNode(Symbol iname) : name(iname) {} ModuleNode() { } };
 struct TypeNode { boost::variant<SimpleType, NamedType> type;
                   TypeNode() {}
                   TypeNode(boost::variant<SimpleType, NamedType> itype) : type(itype) {}};
-struct BlockNode { vector<StatementNode> statements; };
-struct StatementNode { AstNode expr; };
+struct BlockNode { AstList<StatementNode> statements; };
+struct StatementNode { AstNode const* expr = nullptr; };
 struct EmptyStatementNode { };
-struct FunctionNode { std::string name; TypeNode return_type;
-                      vector<ParameterNode> parameters;
+// Nodes that stand for a name or literal keep the byte offset of its token;
+// resolve it with a LineTable when a line and column are needed.
+// A function parsed with lazy bodies has an empty func_body and a lazy_body
+// holding the tokens of its body instead; Body() parses them on first call.
+struct FunctionNode { Symbol name; TypeNode return_type;
+                      uint32_t offset = 0;
+                      AstList<ParameterNode> parameters;
                       BlockNode func_body;
+                      LazyBody* lazy_body = nullptr;
                       FunctionNode() {}
                       FunctionNode(const char* iname, boost::variant<SimpleType, NamedType> itype)
-                        : name(iname), return_type(itype) {} };
-struct ExprNode { vector<AstNode> operations; };
-struct AddNode { AstNode node; };
-struct DecNode { AstNode node; };
-struct MulNode { AstNode node; };
-struct DivNode { AstNode node; };
-struct LetNode { bool mut = false; std::string var_name; AstNode rhs; };
-struct AssignNode { AstNode lhs; AstNode rhs; };
-struct LogicAndNode { AstNode lhs; AstNode rhs; };
-struct NumberNode { int value; };
-struct StringNode { std::string value; };
-struct IdentifierNode { std::string identifier; };
-struct FnCallNode { std::string identifier; };
-struct ParameterNode { TypeNode type; std::string name; };
+                        : name(iname), return_type(itype) {}
+                      BlockNode const& Body() const; };
+struct AddNode { AstNode const* lhs = nullptr; AstNode const* rhs = nullptr; };
+struct DecNode { AstNode const* lhs = nullptr; AstNode const* rhs = nullptr; };
+struct MulNode { AstNode const* lhs = nullptr; AstNode const* rhs = nullptr; };
+struct DivNode { AstNode const* lhs = nullptr; AstNode const* rhs = nullptr; };
+struct LetNode { bool mut = false; Symbol var_name; AstNode const* rhs = nullptr; uint32_t offset = 0; };
+struct AssignNode { AstNode const* lhs = nullptr; AstNode const* rhs = nullptr; };
+struct LogicAndNode { AstNode const* lhs = nullptr; AstNode const* rhs = nullptr; };
+struct LogicEqualNode { AstNode const* lhs = nullptr; AstNode const* rhs = nullptr; };
+struct NumberNode { uint64_t value; uint32_t offset = 0; };
+struct StringNode { std::string_view value; };
+struct IdentifierNode { Symbol identifier; uint32_t offset = 0; };
+struct FnCallNode { Symbol identifier; uint32_t offset = 0; };
+struct ParameterNode { TypeNode type; Symbol name; uint32_t offset = 0; };
+// Stands in for a statement or function that failed to parse, at the offset
+// of its first token
+struct ErrorNode { uint32_t offset = 0; };
+
+// Structural fingerprint of a node, Merkle style: a hash of its kind, its
+// fields and the fingerprints of its children. A node gets it when it is
+// made, after its children, so the parser computes it bottom up at a constant
+// cost per child, and a change anywhere in a subtree changes the fingerprint
+// of every node above it. Source offsets are left out, so code that only
+// moved keeps its fingerprint. Names and strings are hashed by their text,
+// not their Symbol id, which keeps fingerprints the same across processes.
+// A function with a lazy body hashes the tokens of its body instead of its
+// statements.
+uint64_t Fingerprint(AstVariant const& node);
+
+struct AstNode : AstVariant {
+    AstNode() = default;
+    template<typename T, typename = std::enable_if_t<boost::mpl::contains<AstVariant::types, std::decay_t<T>>::value>>
+    AstNode(T&& node) : AstVariant(std::forward<T>(node)), fingerprint(Fingerprint(*this)) { }
+
+    uint64_t fingerprint = 0;   //Of the whole subtree
+};
+
+//Parse functions hand nodes up by value, which is only cheap while a node is
+//a handful of words that point at its children, and its fingerprint
+static_assert(sizeof(AstNode) <= 72, "AstNode should stay small enough to move around by value");
+
+// Structural equality, children compared by value and offsets ignored. Two
+// equal nodes have the same fingerprint unless a function body of one of them
+// is lazy and the other's is not.
+bool operator==(AstNode const& lhs, AstNode const& rhs);
+bool operator==(FileNode const& lhs, FileNode const& rhs);
+bool operator==(ModuleNode const& lhs, ModuleNode const& rhs);
+bool operator==(FunctionNode const& lhs, FunctionNode const& rhs);
+bool operator==(BlockNode const& lhs, BlockNode const& rhs);
+bool operator==(StatementNode const& lhs, StatementNode const& rhs);
+bool operator==(EmptyStatementNode const& lhs, EmptyStatementNode const& rhs);
+bool operator==(LetNode const& lhs, LetNode const& rhs);
+bool operator==(TypeNode const& lhs, TypeNode const& rhs);
+bool operator==(AddNode const& lhs, AddNode const& rhs);
+bool operator==(DecNode const& lhs, DecNode const& rhs);
+bool operator==(MulNode const& lhs, MulNode const& rhs);
+bool operator==(DivNode const& lhs, DivNode const& rhs);
+bool operator==(AssignNode const& lhs, AssignNode const& rhs);
+bool operator==(LogicAndNode const& lhs, LogicAndNode const& rhs);
+bool operator==(LogicEqualNode const& lhs, LogicEqualNode const& rhs);
+bool operator==(NumberNode const& lhs, NumberNode const& rhs);
+bool operator==(StringNode const& lhs, StringNode const& rhs);
+bool operator==(IdentifierNode const& lhs, IdentifierNode const& rhs);
+bool operator==(FnCallNode const& lhs, FnCallNode const& rhs);
+bool operator==(ParameterNode const& lhs, ParameterNode const& rhs);
+bool operator==(ErrorNode const& lhs, ErrorNode const& rhs);
+
+// Expression nodes, which hash-consing may share
+struct is_expression_visitor : public boost::static_visitor<bool> {
+    template<typename T>
+    bool operator()(T const&) const { return false; }
+    bool operator()(AddNode const&) const { return true; }
+    bool operator()(DecNode const&) const { return true; }
+    bool operator()(MulNode const&) const { return true; }
+    bool operator()(DivNode const&) const { return true; }
+    bool operator()(LogicAndNode const&) const { return true; }
+    bool operator()(LogicEqualNode const&) const { return true; }
+    bool operator()(NumberNode const&) const { return true; }
+    bool operator()(StringNode const&) const { return true; }
+    bool operator()(IdentifierNode const&) const { return true; }
+    bool operator()(FnCallNode const&) const { return true; }
+};
+
+// Binding power of binary operators, higher binds tighter
+enum Precedence : uint8_t {
+    PREC_NONE = 0,      //Not a binary operator
+    PREC_LOWEST,
+    PREC_LOGIC_AND = PREC_LOWEST,
+    PREC_LOGIC_EQUAL,
+    PREC_ADD,
+    PREC_MULTIPLY
+};
+
+template<typename T>
+AstNode MakeBinary(AstNode const* lhs, AstNode const* rhs) { return AstNode{T{lhs, rhs}}; }
+
+struct BinaryOperator {
+    uint8_t precedence;
+    AstNode (*make)(AstNode const* lhs, AstNode const* rhs);
+};
+
+//Indexed by PunctuationTypes
+const BinaryOperator binary_operators[] = {
+    {PREC_NONE, nullptr},                           //P_NIL
+    {PREC_LOGIC_EQUAL, MakeBinary<LogicEqualNode>}, //P_LOGIC_EQUAL
+    {PREC_LOGIC_AND, MakeBinary<LogicAndNode>},     //P_LOGIC_AND
+    {PREC_NONE, nullptr},                           //P_RIGHT_ARROW
+    {PREC_NONE, nullptr},                           //P_ASSIGN
+    {PREC_ADD, MakeBinary<AddNode>},                //P_PLUS
+    {PREC_ADD, MakeBinary<DecNode>},                //P_MINUS
+    {PREC_MULTIPLY, MakeBinary<MulNode>},           //P_MULTIPLY
+    {PREC_MULTIPLY, MakeBinary<DivNode>},           //P_DIVIDE
+    {PREC_NONE, nullptr},                           //P_SEMICOLON
+    {PREC_NONE, nullptr},                           //P_DOT
+    {PREC_NONE, nullptr},                           //P_COMMA
+    {PREC_NONE, nullptr},                           //P_OPEN_PAREN
+    {PREC_NONE, nullptr},                           //P_CLOSE_PAREN
+    {PREC_NONE, nullptr},                           //P_OPEN_BRACE
+    {PREC_NONE, nullptr}                            //P_CLOSE_BRACE
+};
+
+static_assert(sizeof(binary_operators) / sizeof(binary_operators[0]) == P_CLOSE_BRACE + 1, "binary_operators[] out of sync with PunctuationTypes");
 
 class Parser {
 public:
-    Parser(Lexer& lex) : m_lexer(lex) { }
+    // Lexes the remaining input of lex up front and parses the token stream.
+    // Lexer and parser errors are reported to diagnostics when given. The
+    // nodes are allocated in arena, or in an arena of the parser if none is
+    // given, and live as long as it.
+    Parser(Lexer& lex, Diagnostics* diagnostics = nullptr, AstArena* arena = nullptr)
+        : m_owned_tokens(Tokenize(Report(lex, diagnostics))), m_tokens(&m_owned_tokens), m_end(m_tokens->size()),
+          m_diagnostics(diagnostics), m_arena(arena ? arena : &m_owned_arena) { }
+    // Parses an already lexed token stream, which must outlive the parser
+    Parser(TokenStream const& tokens, Diagnostics* diagnostics = nullptr, AstArena* arena = nullptr)
+        : m_tokens(&tokens), m_end(tokens.size()), m_diagnostics(diagnostics), m_arena(arena ? arena : &m_owned_arena) { }
+    Parser(Parser const&) = delete;
 
     boost::optional<AstNode> Parse();
     boost::optional<AstNode> ParseFile(const char* filename);
+    // Same tree as ParseFile, with the functions parsed on up to threads
+    // threads, all cores when 0
+    boost::optional<AstNode> ParallelParseFile(const char* filename, unsigned threads = 0);
+    // Parses the block of a function read with lazy bodies
+    static bool ParseLazyBody(LazyBody& body);
     boost::optional<AstNode> ParseFunction();
     boost::optional<AstNode> ParseModule();
     boost::optional<AstNode> ParseStatementBlock();
     boost::optional<AstNode> ParseStatement();
     boost::optional<AstNode> ParseLetStatement();
     boost::optional<TypeNode> ParseType();
-    boost::optional<vector<ParameterNode>> ParseParameters();
-    boost::optional<AstNode> ParseExpression();
+    boost::optional<AstList<ParameterNode>> ParseParameters();
+    boost::optional<AstNode> ParseExpression(uint8_t min_precedence = PREC_LOWEST);
     boost::optional<AstNode> ParseExpressionStatement();
-    boost::optional<AstNode> ParseTerm();
     boost::optional<AstNode> ParseFactor();
     boost::optional<AstNode> ParseNumber();
     boost::optional<AstNode> ParseIdentifier();
 
-    void Error(std::string error_str) { std::cout << error_str << std::endl; };
+    // Reported at the last token read. After an error the parser is in panic
+    // mode until it has synchronized: the errors that follow from the first
+    // one while unwinding are not reported.
+    template<typename... Args>
+    void Error(DiagnosticCode code, Args const&... args) {
+        if(m_panic)
+            return;
+        m_panic = true;
+        m_error_count++;
+        if(m_diagnostics)
+            m_diagnostics->Report(code, m_pos ? m_tokens->offsets[m_pos - 1] : 0, args...);
+    }
+    size_t ErrorCount() const { return m_error_count; }
+
+    AstArena& Arena() const { return *m_arena; }
+
+    // Function bodies are skipped by counting braces and only parsed when
+    // FunctionNode::Body() is first called, for passes that only need the
+    // declarations. The token stream, arena and diagnostics of the parser
+    // must be around until then; with the Lexer constructor the tokens are
+    // the parser's own, so it must be as well. Bodies are parsed on the
+    // thread that asks for them, one at a time.
+    void SetLazyBodies(bool lazy) { m_lazy_bodies = lazy; }
+    // Expressions equal to one stored before share its node instead of
+    // getting their own, found by fingerprint, for generated code that
+    // repeats the same expressions. A shared node stands for several places
+    // in the source, so names and numbers in expressions have offset 0 then.
+    // Bodies parsed lazily are not shared.
+    void SetHashConsing(bool hash_consing) { m_hash_consing = hash_consing; }
 protected:
-    Lexer& m_lexer;
+    static Lexer& Report(Lexer& lex, Diagnostics* diagnostics) {
+        if(diagnostics)
+            lex.SetDiagnostics(diagnostics);
+        return lex;
+    }
+
+    boost::optional<Token> ReadToken() {
+        if(m_pos >= m_end)
+            return boost::none;
+        return (*m_tokens)[m_pos++];
+    }
+
+    boost::optional<Token> PeekToken(size_t ahead = 0) const {
+        if(m_pos + ahead >= m_end)
+            return boost::none;
+        return (*m_tokens)[m_pos + ahead];
+    }
+
+    uint64_t Int(Token const& token) const { return token.data_int(m_tokens->buffer); }
+
+    //Moves a finished child into the arena, or hands out an equal expression
+    //stored before when hash-consing
+    AstNode const* Store(AstNode&& node) {
+        if(m_hash_consing && boost::apply_visitor(is_expression_visitor(), node))
+            return Cons(std::move(node));
+        return m_arena->New<AstNode>(std::move(node));
+    }
+    AstNode const* Cons(AstNode&& node);
+
+    template<typename T>
+    AstListBuilder<T> Builder() { return AstListBuilder<T>(std::get<std::vector<T>>(m_scratch), *m_arena); }
+
+    boost::optional<AstNode> SkipBody(FunctionNode&& node);
+
+    bool AtItemKeyword() const {
+        auto token = PeekToken();
+        return token && token->type() == T_NAME && (token->keyword() == S_FN || token->keyword() == S_MODULE);
+    }
+    // Recovers from an error in the statement or top level item that started
+    // at token start: reports one if the failed parse did not, makes sure at
+    // least one token is skipped and synchronizes
+    AstNode Recover(size_t start, bool top_level);
+    // Skips tokens up to where parsing can go on after an error. In a block
+    // that is past the next ';' or before the next '}', at the top level
+    // before the next 'fn' or 'module'; braces skipped on the way are
+    // matched, and a 'fn' or 'module' outside of them always stops.
+    void Synchronize(bool top_level);
+
+    TokenStream m_owned_tokens;
+    TokenStream const* m_tokens;
+    size_t m_pos = 0;
+    size_t m_end;       //Tokens from here on are out of reach, as if the input ended
+    Diagnostics* m_diagnostics = nullptr;
+    size_t m_error_count = 0;
+    bool m_lazy_bodies = false;
+    bool m_panic = false;
+    bool m_hash_consing = false;
+    std::unordered_multimap<uint64_t, AstNode const*> m_consed;   //By fingerprint
+
+    AstArena m_owned_arena;
+    AstArena* m_arena;
+    std::tuple<vector<AstNode>, vector<StatementNode>, vector<ParameterNode>, vector<ModuleNode>> m_scratch;
 };
 
 boost::optional<AstNode> Parser::ParseLetStatement() {
     LetNode node;
 
     //Parse 'if' identifier
-    auto identifier = m_lexer.ReadToken();
-    if(!identifier || identifier->data_str().compare("let") != 0) {
-        Error("Parse error, expected 'let' identifier in let statement");
+    auto identifier = ReadToken();
+    if(!identifier || identifier->keyword() != S_LET) {
+        Error(D_EXPECTED, "'let' identifier in let statement");
         return boost::none;
     }
 
     //Parse mut or name of variable
-    auto next_token = m_lexer.PeekToken();
+    auto next_token = PeekToken();
     if(!next_token || next_token->type() != T_NAME) {
-        Error("Parse error, expected name of variable in let statement");
+        Error(D_EXPECTED, "name of variable in let statement");
         return boost::none;
     }
 
     //Parse if variable is mutable
-    if(next_token->data_str().compare("mut") == 0) {
+    if(next_token->keyword() == S_MUT) {
         node.mut = true;
-        m_lexer.ReadToken();
+        ReadToken();
     }
 
     //Parse name of variable
-    auto name_token = m_lexer.ReadToken();
+    auto name_token = ReadToken();
     if(!name_token || name_token->type() != T_NAME) {
-        Error("Parse error, expected name of variable in let statement");
+        Error(D_EXPECTED, "name of variable in let statement");
         return boost::none;
     }
 
-    node.var_name = name_token->data_str();
+    node.var_name = name_token->name();
+    node.offset = name_token->offset;
 
     //Parse '=' or end of let statement ';'
-    next_token = m_lexer.ReadToken();
+    next_token = ReadToken();
     if(!next_token) {
-        Error("Parse error, end of file reached in let statement");
+        Error(D_UNEXPECTED_EOF, "let statement");
         return boost::none;
     }
 
     if(next_token->subtype() == P_ASSIGN) {    //Read assignment to variable
         auto expr = ParseExpression();
         if(!expr) {
-            Error("Parse error, expected expression in let statement");
+            Error(D_EXPECTED, "expression in let statement");
             return boost::none;
         }
 
-        node.rhs = expr.get();
+        node.rhs = Store(std::move(*expr));
         
         //Read the ending semi-colon
-        next_token = m_lexer.ReadToken(); 
+        next_token = ReadToken(); 
+        if(!next_token) {
+            Error(D_UNEXPECTED_EOF, "let statement");
+            return boost::none;
+        }
     }
     
     if(next_token->subtype() != P_SEMICOLON) { //End of let statement
-        Error("Parse error, expected assignment or end of let statement");
+        Error(D_EXPECTED, "assignment or end of let statement");
         return boost::none;
     }
 
-    return AstNode{node};
+    return AstNode{std::move(node)};
 }
 
-boost::optional<AstNode> Parser::ParseExpression() {
-    ExprNode node;
-
-    auto first_term = ParseTerm();
-    if(!first_term) {
-        Error("Parse error, expected term in expression");
+// Precedence climbing: parses operands with ParseFactor and folds them into
+// binary nodes while the next operator binds at least as tight as
+// min_precedence. All operators are left associative.
+boost::optional<AstNode> Parser::ParseExpression(uint8_t min_precedence) {
+    auto lhs = ParseFactor();
+    if(!lhs) {
+        Error(D_EXPECTED, "term in expression");
         return boost::none;
     }
-    
-    node.operations.push_back(first_term.get());
-
-    bool in_expression = true;
-    //Loop until there are no more add or subtract operations
-    for(auto next_token = m_lexer.PeekToken();
-        next_token && in_expression;
-        next_token = m_lexer.PeekToken()) {
-
-        auto type = next_token->subtype();
-        if(type == P_PLUS) {
-            m_lexer.ReadToken(); //Eat the plus sign
-            auto term = ParseTerm(); //Read the term after the '+'
-            if(!term) {
-                Error("Parse error, expected a term in add expression");
-                return boost::none;
-            }
 
-            //Save this add operation in the expression node
-            AddNode addop;
-            addop.node = term.get();
-            node.operations.push_back(AstNode{addop});
-        }
-        else if(type == P_MINUS) {
-            m_lexer.ReadToken(); //Eat the minus sign
-            auto term = ParseTerm(); //Read the term after the '+'
-            if(!term) {
-                Error("Parse error, expected a term in add expression");
-                return boost::none;
-            }
+    for(auto next_token = PeekToken(); next_token; next_token = PeekToken()) {
+        if(next_token->type() != T_PUNCTUATION)
+            break;
+        auto const& op = binary_operators[next_token->subtype()];
+        if(op.precedence == PREC_NONE || op.precedence < min_precedence)
+            break;
 
-            //Save this dec operation in the expression node
-            DecNode decop;
-            decop.node = term.get();
-            node.operations.push_back(AstNode{decop});
+        ReadToken(); //Eat the operator
+        auto rhs = ParseExpression(op.precedence + 1);
+        if(!rhs) {
+            Error(D_EXPECTED, "a term after binary operator");
+            return boost::none;
         }
-        else
-            in_expression = false;
-    }
-
-    return AstNode{node};
-}
-
-//Parse an expression term
-boost::optional<AstNode> Parser::ParseTerm() {
-    ExprNode node;
 
-    auto first_factor = ParseFactor();
-    if(!first_factor) {
-        Error("Parse error, expected a factor in expression term");
-        return boost::none;
+        auto left = Store(std::move(*lhs));
+        lhs = op.make(left, Store(std::move(*rhs)));
     }
-    
-    node.operations.push_back(first_factor.get());
-
-    bool in_term = true;
-    //Loop until there are no more multiply or divide operations
-    for(auto next_token = m_lexer.PeekToken();
-        next_token && in_term;
-        next_token = m_lexer.PeekToken()) {
-
-            auto type = next_token->subtype();
-            if(type == P_MULTIPLY) {
-                m_lexer.ReadToken(); //Eat the multiply sign
-                auto factor = ParseFactor(); //Read the term after the '*'
-                if(!factor) {
-                    Error("Parse error, expected a term in add expression");
-                    return boost::none;
-                }
-
-                //Save this multiplication operation in the expression term node
-                MulNode mulop;
-                mulop.node = factor.get();
-                node.operations.push_back(AstNode{mulop});
-            }
-            else if(type == P_DIVIDE) {
-                m_lexer.ReadToken(); //Eat the divide sign
-                auto factor = ParseFactor(); //Read the factor after the '+'
-                if(!factor) {
-                    Error("Parse error, expected a term in add expression");
-                    return boost::none;
-                }
 
-                //Save this division operation in the expression term node
-                DivNode divop;
-                divop.node = factor.get();
-                node.operations.push_back(AstNode{divop});
-            }
-            else
-                in_term = false;
-    }
-    
-    return AstNode{node};
+    return lhs;
 }
 
 boost::optional<AstNode> Parser::ParseFactor() {
-    auto next_token = m_lexer.PeekToken();
+    auto next_token = PeekToken();
     if(!next_token) {
-        Error("Parse error, expected a token in expression factor");
+        Error(D_EXPECTED, "a token in expression factor");
         return boost::none;
     }
 
@@ -293,86 +452,91 @@ boost::optional<AstNode> Parser::ParseFactor() {
 
     //Check if this factor is an expression enclosed in parens ( expression )
     if(next_token->subtype() == P_OPEN_PAREN) {
-        m_lexer.ReadToken(); //Eat the open paren '('
+        ReadToken(); //Eat the open paren '('
 
         auto expr = ParseExpression();
         if(!expr) {
-            Error("Parse error, expected expression");
+            Error(D_EXPECTED, "expression");
             return boost::none;
         }
 
         //This factor node is an expression
-        node = expr.get();
+        node = std::move(*expr);
 
-        auto closing_paren = m_lexer.ReadToken();
+        auto closing_paren = ReadToken();
+        if(!closing_paren) {
+            Error(D_UNEXPECTED_EOF, "expression factor");
+            return boost::none;
+        }
         if(closing_paren->subtype() != P_CLOSE_PAREN) {
-            Error("Parse error, expected a paren closing expression factor");
+            Error(D_EXPECTED, "a paren closing expression factor");
             return boost::none;
         }
     }
     else if(next_token->type() == T_NAME) {
         auto ident = ParseIdentifier();
         if(!ident) {
-            Error("Parse error, expected identifier in expression factor");
+            Error(D_EXPECTED, "identifier in expression factor");
             return boost::none;
         }
         
-        node = ident.get();
+        node = std::move(*ident);
     }
     else
     {
         auto number = ParseNumber();
         if(!number) {
-            Error("Parse error, expected a number in expression factor");
+            Error(D_EXPECTED, "a number in expression factor");
             return boost::none;
         }
-        node = number.get();
+        node = std::move(*number);
     }
 
     return node;
 }
 
 boost::optional<AstNode> Parser::ParseNumber() {
-    auto token = m_lexer.ReadToken();
+    auto token = ReadToken();
     if(!token || token->type() != T_NUMBER) {
         return boost::none;
     }
 
     NumberNode node;
-    node.value = token->data_int();
+    node.value = Int(*token);
+    node.offset = token->offset;
     return AstNode{node};
 }
 
 boost::optional<AstNode> Parser::ParseIdentifier() {
-    auto identifier_name = m_lexer.ReadToken();
+    auto identifier_name = ReadToken();
     if(!identifier_name || identifier_name->type() != T_NAME) {
-        Error("Parse error, expected identifier");
+        Error(D_EXPECTED, "identifier");
         return boost::none;
     }
     
-    auto next_token = m_lexer.PeekToken();
+    auto next_token = PeekToken();
     if(next_token && next_token->subtype() == P_OPEN_PAREN) {
-        m_lexer.ReadToken(); //Eat open paren
+        ReadToken(); //Eat open paren
         
         //Parse arguments
         
-        auto closing_paren = m_lexer.ReadToken();
+        auto closing_paren = ReadToken();
         if(!closing_paren || closing_paren->subtype() != P_CLOSE_PAREN) {
-            Error("Parse error, function call arguments must end with ')'");
+            Error(D_EXPECTED, "')' ending function call arguments");
             return boost::none;
         }
         
-        auto fn_call_node = FnCallNode{identifier_name.get().data_str()};
+        auto fn_call_node = FnCallNode{identifier_name->name(), identifier_name->offset};
         
         return AstNode{fn_call_node}; 
     }
     
-    return AstNode{IdentifierNode{identifier_name.get().data_str()}};
+    return AstNode{IdentifierNode{identifier_name->name(), identifier_name->offset}};
 }
 
 
 boost::optional<AstNode> Parser::ParseExpressionStatement() {
-    m_lexer.ReadToken();
+    ReadToken();
 
     return boost::none;
 }
@@ -380,7 +544,7 @@ boost::optional<AstNode> Parser::ParseExpressionStatement() {
 boost::optional<AstNode> Parser::ParseStatement() {
     StatementNode node;
 
-    auto token = m_lexer.PeekToken();
+    auto token = PeekToken();
     if(!token)
         return boost::none;
 
@@ -388,118 +552,126 @@ boost::optional<AstNode> Parser::ParseStatement() {
     switch(token_type) {
         case T_NUMBER:
         case T_STRING:
-            Error("Parse error, expected statement");
-            break;
+            Error(D_EXPECTED, "statement");
+            return boost::none;
         case T_NAME: {
-            auto token_str = token->data_str();
-            if(token_str.compare("let") == 0) {
+            auto keyword = token->keyword();
+            if(keyword == S_LET) {
                 auto let_statement = ParseLetStatement();   
                 if(!let_statement)
                     return boost::none;
                 
-                node.expr = *let_statement;
+                node.expr = Store(std::move(*let_statement));
+            }
+            else if(keyword == S_RETURN || keyword == S_IF) {
+               /*ParseReturnStatement(), ParseIfStatement()*/
+               Error(D_UNKNOWN_STATEMENT);
+               return boost::none;
             }
-            else if(token_str.compare("return") == 0)
-               /*ParseReturnStatement()*/;
-            else if(token_str.compare("if") == 0)
-               /*ParseIfStatement()*/;
             else
-               ParseExpressionStatement();
+               return ParseExpressionStatement();
             break;
         }
         case T_PUNCTUATION: {
                 if(token->subtype() == P_SEMICOLON) {
                     //Empty statement
-                    m_lexer.ReadToken();
+                    ReadToken();
                     return AstNode{EmptyStatementNode{}};
                 }
             }
-            break;
+            Error(D_UNKNOWN_STATEMENT);
+            return boost::none;
         default:
-            Error("Parse error, unknown statement in code block");
+            Error(D_UNKNOWN_STATEMENT);
             return boost::none;
     }
 
-    return AstNode{node};
+    return AstNode{std::move(node)};
 }
 
 boost::optional<AstNode> Parser::ParseStatementBlock() {
-    BlockNode node;
+    auto statements = Builder<StatementNode>();
 
     //Parse opening brace
-    auto opening_brace = m_lexer.ReadToken();
+    auto opening_brace = ReadToken();
     if(!opening_brace ||opening_brace->subtype() != P_OPEN_BRACE) {
-        Error("Parse error, expected '{' parsing code block");
+        Error(D_EXPECTED, "'{' parsing code block");
         return boost::none;
     }
 
+    //A statement that fails is replaced by an error node and parsing goes on
+    //after it, a block cut short by the end of the file or the next function
+    //keeps the statements read so far
     bool in_block = true;
     while(in_block) {
-        auto next_token = m_lexer.PeekToken();
+        auto next_token = PeekToken();
         
         if(!next_token) {
-            Error("Parse error, unexpectedly reached end of file in code block");
-            return boost::none;
+            Error(D_UNEXPECTED_EOF, "code block");
+            break;
         }
 
         if(next_token->subtype() == P_CLOSE_BRACE) {
             //Parse closing brace
-            auto closing_brace = m_lexer.ReadToken();
+            auto closing_brace = ReadToken();
             in_block = false;
         }
+        else if(AtItemKeyword()) {
+            Error(D_EXPECTED, "'}' closing code block");
+            break;
+        }
         else {
+            auto start = m_pos;
+            m_panic = false;
             auto statement = ParseStatement();
-            if(!statement) {
-                return boost::none;
-            }
 
             //Add if this is a statement node
             auto visitor = boost::hana::overload_linearly(
-                [&node](StatementNode& rs) -> bool { node.statements.push_back(rs); return true; },
+                [&statements](StatementNode& rs) -> bool { statements.push_back(std::move(rs)); return true; },
                 [](EmptyStatementNode&) -> bool { return true; }, //Ignore empty statements
-                [this](auto&) -> bool { Error("Parse error, expected statement node"); return false; }
+                [this](auto&) -> bool { Error(D_EXPECTED, "statement node"); return false; }
                 );
-            if(!boost::apply_visitor(visitor, statement.get()))
-                return boost::none;
+            if(!statement || !boost::apply_visitor(visitor, *statement))
+                statements.push_back(StatementNode{Store(Recover(start, false))});
         }
     }
 
-    return AstNode{node};
+    return AstNode{BlockNode{statements.List()}};
 }
 
 boost::optional<TypeNode> Parser::ParseType() {
-    auto type = m_lexer.ReadToken();
+    auto type = ReadToken();
     if(!type || type->type() != T_NAME) {
-        Error("Parse error, expected type");
+        Error(D_EXPECTED, "type");
         return boost::none;
     }
     
     TypeNode node;
         
-    auto str = type->data_str();
-    if(str.compare("int") == 0)
-        node.type = TYPE_INT;
-    else if(str.compare("uint") == 0)
-        node.type = TYPE_UINT;
-    else if(str.compare("char") == 0)
-        node.type = TYPE_CHAR;
-    else if(str.compare("void") == 0)
-        node.type = TYPE_VOID;
-    else {
-        node.type = NamedType{str};
+    switch(type->keyword()) {
+        case S_INT:
+            node.type = TYPE_INT; break;
+        case S_UINT:
+            node.type = TYPE_UINT; break;
+        case S_CHAR:
+            node.type = TYPE_CHAR; break;
+        case S_VOID:
+            node.type = TYPE_VOID; break;
+        default:
+            node.type = NamedType{type->name()};
     }
     
     return node;
 }
 
-boost::optional<vector<ParameterNode>> Parser::ParseParameters() {
-    vector<ParameterNode> params;
+boost::optional<AstList<ParameterNode>> Parser::ParseParameters() {
+    auto params = Builder<ParameterNode>();
 
     bool in_parameter_list = true;
     while(in_parameter_list) {
-        auto next_token = m_lexer.PeekToken();
+        auto next_token = PeekToken();
         if(!next_token) {
-            Error("Parse error, Unexpected end of file in parameter list");
+            Error(D_UNEXPECTED_EOF, "parameter list");
             return boost::none;
         }
         
@@ -510,109 +682,114 @@ boost::optional<vector<ParameterNode>> Parser::ParseParameters() {
             ParameterNode node;
             auto type = ParseType();
             if(!type) {
-                Error("Parse error, expected type of parameter in parameter list");
+                Error(D_EXPECTED, "type of parameter in parameter list");
                 return boost::none;
             }
             
-            node.type = type.get();
+            node.type = std::move(*type);
             
-            next_token = m_lexer.PeekToken();
+            next_token = PeekToken();
             if(!next_token) {
-                Error("Parse error, Unexpected end of file in parameter list");
+                Error(D_UNEXPECTED_EOF, "parameter list");
                 return boost::none;
             }
             
             if(next_token->type() == T_NAME) {
-                auto name = m_lexer.ReadToken();
+                auto name = ReadToken();
                 if(!name || name->type() != T_NAME) {
-                    Error("Parse error, expected name of parameter");
+                    Error(D_EXPECTED, "name of parameter");
                     return boost::none;
                 }
-                node.name = name->data_str();
+                node.name = name->name();
+                node.offset = name->offset;
                 
-                next_token = m_lexer.PeekToken();
+                next_token = PeekToken();
                 if(!next_token) {
-                    Error("Parse error, Unexpected end of file in parameter list");
+                    Error(D_UNEXPECTED_EOF, "parameter list");
                     return boost::none;
                 }
             }
             
             if(next_token->subtype() == P_COMMA)
-                m_lexer.ReadToken(); //Eat the comma
+                ReadToken(); //Eat the comma
             else {
                 if(next_token->subtype() == P_CLOSE_PAREN)
                     in_parameter_list = false;
                 else {
-                    Error("Parse error, invalid token in parameter list");
+                    Error(D_INVALID_TOKEN, "parameter list");
                     return boost::none;
                 }
             }
-            params.emplace_back(node);
+            params.push_back(std::move(node));
         }
     }
     
-    return params;
+    return params.List();
 }
 
 boost::optional<AstNode> Parser::ParseFunction() {
     FunctionNode node;
 
     //Parse keyword "fn"
-    auto identifier = m_lexer.ReadToken();
-    if(!identifier || identifier->data_str().compare("fn") != 0) {
-        Error("Parse error, expected keyword fn");
+    auto identifier = ReadToken();
+    if(!identifier || identifier->keyword() != S_FN) {
+        Error(D_EXPECTED, "keyword fn");
         return boost::none;
     }
 
     //Parse name of function
-    auto func_name = m_lexer.ReadToken();
+    auto func_name = ReadToken();
     if(!func_name || func_name->type() != T_NAME) {
-        Error("Parse error, expected name of function");
+        Error(D_EXPECTED, "name of function");
         return boost::none;
     }
 
-    node.name = func_name->data_str();
+    node.name = func_name->name();
+    node.offset = func_name->offset;
 
     //Parse open paren
-    auto open_paren = m_lexer.ReadToken();
+    auto open_paren = ReadToken();
     if(!open_paren || open_paren->subtype() != P_OPEN_PAREN) {
-        Error("Parse error, expected opening paren");
+        Error(D_EXPECTED, "opening paren");
         return boost::none;
     }
 
     //Parse parameters
     auto parameters = ParseParameters();
     if(!parameters) {
-        Error("Parse error, expected function parameters");
+        Error(D_EXPECTED, "function parameters");
         return boost::none;
     }
     
-    node.parameters = parameters.get();
+    node.parameters = std::move(*parameters);
 
     //Parse close paren
-    auto close_paren = m_lexer.ReadToken();
+    auto close_paren = ReadToken();
     if(!close_paren || close_paren->subtype() != P_CLOSE_PAREN) {
-        Error("Parse error, expected closing paren");
+        Error(D_EXPECTED, "closing paren");
         return boost::none;
     }
     
     //Parse optional return type
-    auto next_token = m_lexer.PeekToken();
+    auto next_token = PeekToken();
     if(next_token && next_token->subtype() == P_RIGHT_ARROW) {
-        m_lexer.ReadToken(); //Eat '->' operator
+        ReadToken(); //Eat '->' operator
         
         auto type = ParseType();
         if(!type) {
-            Error("Parse error, expected type expression");
+            Error(D_EXPECTED, "type expression");
             return boost::none;
         }
         
-        node.return_type = type.get();
+        node.return_type = std::move(*type);
     }
     else {
         node.return_type = TypeNode{TYPE_VOID};
     }
 
+    if(m_lazy_bodies)
+        return SkipBody(std::move(node));
+
     //Read statement block
     auto block = ParseStatementBlock();
     if(!block) {
@@ -623,69 +800,485 @@ boost::optional<AstNode> Parser::ParseFunction() {
         [](BlockNode& node) -> boost::optional<BlockNode&> { return node; },
         [](auto&) -> boost::optional<BlockNode&> { return boost::none; }
         );
-    auto func_body = boost::apply_visitor(visitor, block.get());
+    auto func_body = boost::apply_visitor(visitor, *block);
     if(func_body)
-        node.func_body = func_body.get();
+        node.func_body = std::move(*func_body);
     else {
-        Error("Parse error, expected function body");
+        Error(D_EXPECTED, "function body");
         return boost::none;
     }
 
-    return AstNode{node};
+    return AstNode{std::move(node)};
+}
+
+uint64_t HashMix(uint64_t hash, uint64_t value) {
+    hash^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+    hash*= 0xff51afd7ed558ccdull;
+    return hash ^ (hash >> 33);
+}
+
+//Eight bytes at a time, fixed instead of std::hash so fingerprints do not
+//depend on the build
+uint64_t HashText(std::string_view text) {
+    uint64_t hash = text.size();
+    size_t i = 0;
+    for(; i + 8 <= text.size(); i+= 8) {
+        uint64_t word;
+        std::memcpy(&word, text.data() + i, 8);
+        hash = HashMix(hash, word);
+    }
+    uint64_t tail = 0;
+    for(size_t shift = 0; i < text.size(); ++i, shift+= 8)
+        tail|= uint64_t(uint8_t(text[i])) << shift;
+    return HashMix(hash, tail);
+}
+
+//Hashes of recent names of the calling thread, to spare the lock of the
+//interner on every name
+struct NameHash {
+    uint32_t id = S_NONE;
+    uint64_t hash = 0;
+};
+const size_t name_hash_cache_size = 1024;
+thread_local NameHash name_hash_cache[name_hash_cache_size] = {};
+
+uint64_t HashName(Symbol symbol) {
+    auto& cached = name_hash_cache[symbol.id % name_hash_cache_size];
+    if(cached.id != symbol.id || symbol.id == S_NONE)
+        cached = NameHash { symbol.id, HashText(symbol.view()) };
+    return cached.hash;
+}
+
+// The tokens of a function body not parsed yet, kept in the arena
+struct LazyBody {
+    LazyBody(TokenStream const* itokens, uint32_t ifirst, uint32_t iend, AstArena* iarena, Diagnostics* idiagnostics, uint64_t ifingerprint)
+        : tokens(itokens), first(ifirst), end(iend), arena(iarena), diagnostics(idiagnostics), fingerprint(ifingerprint) { }
+
+    TokenStream const* tokens;
+    uint32_t first;     //The opening brace
+    uint32_t end;       //Past the closing brace
+    AstArena* arena;
+    Diagnostics* diagnostics;
+    uint64_t fingerprint;   //Of the tokens, for the fingerprint of the function
+    bool parsed = false;
+    bool failed = false;
+    BlockNode block;
+};
+
+boost::optional<AstNode> Parser::SkipBody(FunctionNode&& node) {
+    auto open_brace = PeekToken();
+    if(!open_brace || open_brace->subtype() != P_OPEN_BRACE) {
+        Error(D_EXPECTED, "'{' parsing code block");
+        return boost::none;
+    }
+
+    //The tokens are hashed on the way, punctuation by its id, names by their
+    //text and literals by their kind and text
+    auto first = m_pos;
+    int depth = 0;
+    uint64_t hash = 0;
+    while(auto token = ReadToken()) {
+        if(token->type() != T_PUNCTUATION) {
+            auto value = token->type() == T_NAME ? HashName(token->name()) : HashMix(HashText(m_tokens->Text(m_pos - 1)), token->type());
+            hash = (hash ^ value) * 0x100000001b3ull;
+            continue;
+        }
+        hash = (hash ^ token->subtype()) * 0x100000001b3ull;
+        if(token->subtype() == P_OPEN_BRACE)
+            depth++;
+        else if(token->subtype() == P_CLOSE_BRACE && --depth == 0) {
+            node.lazy_body = m_arena->New<LazyBody>(m_tokens, uint32_t(first), uint32_t(m_pos), m_arena, m_diagnostics, HashMix(hash, 0));
+            return AstNode{std::move(node)};
+        }
+    }
+
+    Error(D_UNEXPECTED_EOF, "code block");
+    return boost::none;
+}
+
+bool Parser::ParseLazyBody(LazyBody& body) {
+    if(body.parsed)
+        return !body.failed;
+
+    Parser parser(*body.tokens, body.diagnostics, body.arena);
+    parser.m_pos = body.first;
+    parser.m_end = body.end;
+    auto block = parser.ParseStatementBlock();
+    body.parsed = true;
+    body.failed = !block || parser.ErrorCount() || parser.m_pos != parser.m_end;
+    if(block)
+        body.block = boost::get<BlockNode>(*block);
+    return !body.failed;
+}
+
+//The errors of a body go to the diagnostics of the parser when it is parsed
+BlockNode const& FunctionNode::Body() const {
+    if(!lazy_body)
+        return func_body;
+    Parser::ParseLazyBody(*lazy_body);
+    return lazy_body->block;
+}
+
+
+// Hashes one node from its fields and the fingerprints its children already
+// have; only the nodes kept in lists, which are no AstNodes, are hashed again
+class Fingerprinter : public boost::static_visitor<uint64_t> {
+public:
+    uint64_t operator()(FileNode const& node) const {
+        auto hash = HashMix(HashText(node.name), node.modules.size());
+        for(auto const& module : node.modules)
+            hash = HashMix(hash, (*this)(module));
+        return hash;
+    }
+    uint64_t operator()(ModuleNode const& node) const {
+        auto hash = HashMix(node.name ? Name(*node.name) : 0, node.functions.size());
+        for(auto const& function : node.functions)
+            hash = HashMix(hash, function.fingerprint);
+        return hash;
+    }
+    uint64_t operator()(FunctionNode const& node) const {
+        auto hash = HashMix(Name(node.name), (*this)(node.return_type));
+        hash = HashMix(hash, node.parameters.size());
+        for(auto const& parameter : node.parameters)
+            hash = HashMix(hash, (*this)(parameter));
+        if(!node.lazy_body)
+            return HashMix(hash, (*this)(node.func_body));
+
+        return HashMix(hash, node.lazy_body->fingerprint);
+    }
+    uint64_t operator()(BlockNode const& node) const {
+        auto hash = HashMix(0, node.statements.size());
+        for(auto const& statement : node.statements)
+            hash = HashMix(hash, (*this)(statement));
+        return hash;
+    }
+    uint64_t operator()(StatementNode const& node) const { return Child(node.expr); }
+    uint64_t operator()(EmptyStatementNode const&) const { return 0; }
+    uint64_t operator()(LetNode const& node) const { return HashMix(HashMix(node.mut, Name(node.var_name)), Child(node.rhs)); }
+    uint64_t operator()(TypeNode const& node) const {
+        return boost::apply_visitor(boost::hana::overload(
+            [](SimpleType type) { return HashMix(0, uint64_t(type)); },
+            [](NamedType const& type) { return HashMix(1, Name(type.name)); }
+        ), node.type);
+    }
+    uint64_t operator()(AddNode const& node) const { return Binary(node.lhs, node.rhs); }
+    uint64_t operator()(DecNode const& node) const { return Binary(node.lhs, node.rhs); }
+    uint64_t operator()(MulNode const& node) const { return Binary(node.lhs, node.rhs); }
+    uint64_t operator()(DivNode const& node) const { return Binary(node.lhs, node.rhs); }
+    uint64_t operator()(AssignNode const& node) const { return Binary(node.lhs, node.rhs); }
+    uint64_t operator()(LogicAndNode const& node) const { return Binary(node.lhs, node.rhs); }
+    uint64_t operator()(LogicEqualNode const& node) const { return Binary(node.lhs, node.rhs); }
+    uint64_t operator()(NumberNode const& node) const { return HashMix(0, node.value); }
+    uint64_t operator()(StringNode const& node) const { return HashText(node.value); }
+    uint64_t operator()(IdentifierNode const& node) const { return Name(node.identifier); }
+    uint64_t operator()(FnCallNode const& node) const { return Name(node.identifier); }
+    uint64_t operator()(ParameterNode const& node) const { return HashMix((*this)(node.type), Name(node.name)); }
+    uint64_t operator()(ErrorNode const&) const { return 0; }
+
+protected:
+    static uint64_t Name(Symbol symbol) { return HashName(symbol); }
+    static uint64_t Child(AstNode const* node) { return node ? node->fingerprint : 0; }
+    static uint64_t Binary(AstNode const* lhs, AstNode const* rhs) { return HashMix(Child(lhs), Child(rhs)); }
+};
+
+uint64_t Fingerprint(AstVariant const& node) {
+    return HashMix(boost::apply_visitor(Fingerprinter(), node), uint64_t(node.which()));
+}
+
+//Null children are equal to each other, shared children without looking
+bool SameChild(AstNode const* lhs, AstNode const* rhs) { return lhs == rhs || (lhs && rhs && *lhs == *rhs); }
+
+template<typename T>
+bool SameList(AstList<T> const& lhs, AstList<T> const& rhs) { return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end()); }
+
+bool operator==(AstNode const& lhs, AstNode const& rhs) {
+    return static_cast<AstVariant const&>(lhs) == static_cast<AstVariant const&>(rhs);
+}
+
+bool operator==(FileNode const& lhs, FileNode const& rhs) { return lhs.name == rhs.name && SameList(lhs.modules, rhs.modules); }
+bool operator==(ModuleNode const& lhs, ModuleNode const& rhs) { return lhs.name == rhs.name && SameList(lhs.functions, rhs.functions); }
+// Compares bodies without parsing them. A body that is not parsed yet equals
+// a lazy body over the same tokens or with the same fingerprint, never an
+// eagerly parsed one.
+bool SameBody(FunctionNode const& lhs, FunctionNode const& rhs) {
+    auto unparsed = [](FunctionNode const& node) { return node.lazy_body && !node.lazy_body->parsed; };
+    if(lhs.lazy_body && rhs.lazy_body) {
+        auto const& l = *lhs.lazy_body;
+        auto const& r = *rhs.lazy_body;
+        if(l.tokens == r.tokens && l.first == r.first && l.end == r.end)
+            return true;
+        if(unparsed(lhs) || unparsed(rhs))
+            return l.fingerprint == r.fingerprint;
+    }
+    else if(unparsed(lhs) || unparsed(rhs))
+        return false;
+    return lhs.Body() == rhs.Body();
+}
+
+bool operator==(FunctionNode const& lhs, FunctionNode const& rhs) {
+    return lhs.name == rhs.name && lhs.return_type == rhs.return_type &&
+           SameList(lhs.parameters, rhs.parameters) && SameBody(lhs, rhs);
+}
+bool operator==(BlockNode const& lhs, BlockNode const& rhs) { return SameList(lhs.statements, rhs.statements); }
+bool operator==(StatementNode const& lhs, StatementNode const& rhs) { return SameChild(lhs.expr, rhs.expr); }
+bool operator==(EmptyStatementNode const&, EmptyStatementNode const&) { return true; }
+bool operator==(LetNode const& lhs, LetNode const& rhs) {
+    return lhs.mut == rhs.mut && lhs.var_name == rhs.var_name && SameChild(lhs.rhs, rhs.rhs);
+}
+bool operator==(TypeNode const& lhs, TypeNode const& rhs) { return lhs.type == rhs.type; }
+bool operator==(AddNode const& lhs, AddNode const& rhs) { return SameChild(lhs.lhs, rhs.lhs) && SameChild(lhs.rhs, rhs.rhs); }
+bool operator==(DecNode const& lhs, DecNode const& rhs) { return SameChild(lhs.lhs, rhs.lhs) && SameChild(lhs.rhs, rhs.rhs); }
+bool operator==(MulNode const& lhs, MulNode const& rhs) { return SameChild(lhs.lhs, rhs.lhs) && SameChild(lhs.rhs, rhs.rhs); }
+bool operator==(DivNode const& lhs, DivNode const& rhs) { return SameChild(lhs.lhs, rhs.lhs) && SameChild(lhs.rhs, rhs.rhs); }
+bool operator==(AssignNode const& lhs, AssignNode const& rhs) { return SameChild(lhs.lhs, rhs.lhs) && SameChild(lhs.rhs, rhs.rhs); }
+bool operator==(LogicAndNode const& lhs, LogicAndNode const& rhs) { return SameChild(lhs.lhs, rhs.lhs) && SameChild(lhs.rhs, rhs.rhs); }
+bool operator==(LogicEqualNode const& lhs, LogicEqualNode const& rhs) { return SameChild(lhs.lhs, rhs.lhs) && SameChild(lhs.rhs, rhs.rhs); }
+bool operator==(NumberNode const& lhs, NumberNode const& rhs) { return lhs.value == rhs.value; }
+bool operator==(StringNode const& lhs, StringNode const& rhs) { return lhs.value == rhs.value; }
+bool operator==(IdentifierNode const& lhs, IdentifierNode const& rhs) { return lhs.identifier == rhs.identifier; }
+bool operator==(FnCallNode const& lhs, FnCallNode const& rhs) { return lhs.identifier == rhs.identifier; }
+bool operator==(ParameterNode const& lhs, ParameterNode const& rhs) { return lhs.type == rhs.type && lhs.name == rhs.name; }
+bool operator==(ErrorNode const&, ErrorNode const&) { return true; }
+
+// Equal expressions have equal fingerprints and, their operands being shared
+// already, compare equal without going deeper than one level. Leaves drop the
+// offset of their token first, a shared leaf has no single one.
+AstNode const* Parser::Cons(AstNode&& node) {
+    if(auto number = boost::get<NumberNode>(&node))
+        number->offset = 0;
+    else if(auto identifier = boost::get<IdentifierNode>(&node))
+        identifier->offset = 0;
+    else if(auto call = boost::get<FnCallNode>(&node))
+        call->offset = 0;
+
+    auto range = m_consed.equal_range(node.fingerprint);
+    for(auto it = range.first; it != range.second; ++it) {
+        if(*it->second == node)
+            return it->second;
+    }
+    auto stored = m_arena->New<AstNode>(std::move(node));
+    m_consed.emplace(stored->fingerprint, stored);
+    return stored;
 }
 
 boost::optional<AstNode> Parser::ParseModule() {
+    //Not in the language yet, the caller skips up to the next item
+    ReadToken(); //Eat 'module'
+    Error(D_MODULE_UNSUPPORTED);
     return boost::none;
 }
 
-boost::optional<AstNode> Parser::ParseFile(const char* ) {
+boost::optional<AstNode> Parser::ParseFile(const char* filename) {
     FileNode file = FileNode{};
+    file.name = m_arena->Str(filename);
 
     auto module = ModuleNode{};
-
-    while(auto token = m_lexer.PeekToken()) {
+    auto functions = Builder<AstNode>();
+    auto modules = Builder<ModuleNode>();
+
+    //An item that fails is replaced by an error node and parsing goes on at
+    //the next function or module
+    while(auto token = PeekToken()) {
+        auto start = m_pos;
+        m_panic = false;
         if(token->type() == T_NAME) {
-            if(token->data_str() == "fn") {           //Parse a free function
+            if(token->keyword() == S_FN) {           //Parse a free function
                 auto function = ParseFunction();
 
-                if(!function)
-                    return boost::none;
-
-                module.functions.push_back(function.get());
+                if(function)
+                    functions.push_back(std::move(*function));
+                else
+                    functions.push_back(Recover(start, true));
             }
-            else if(token->data_str() == "module") { //Parse a module
+            else if(token->keyword() == S_MODULE) { //Parse a module
                 auto ast_module = ParseModule();
 
-                if(!ast_module)
-                    return boost::none;
+                if(!ast_module) {
+                    functions.push_back(Recover(start, true));
+                    continue;
+                }
 
-                auto m = boost::get<ModuleNode>(ast_module.get());
-                for(auto const& it : file.modules) {
+                auto m = std::move(boost::get<ModuleNode>(*ast_module));
+                for(auto const& it : modules) {
                     if(it.name && m.name) {
                         if (it.name.get() == m.name.get())
-                            Error("Parse error, module already exists");
+                            Error(D_MODULE_EXISTS, m.name.get());
                     }
                 }
-                file.modules.push_back(m);
+                modules.push_back(std::move(m));
             }
             else {
-                Error("Parse error, expected function or module.");
-                return boost::none;
+                Error(D_EXPECTED, "function or module");
+                functions.push_back(Recover(start, true));
             }
         }
         else {
-            Error("Expected identifier");
-            return boost::none;
+            Error(D_EXPECTED, "identifier");
+            functions.push_back(Recover(start, true));
         }
     }
 
-    file.modules.emplace_back(module);
+    module.functions = functions.List();
+    modules.push_back(std::move(module));
+    file.modules = modules.List();
 
-    return AstNode{file};
+    return AstNode{std::move(file)};
+}
+
+AstNode Parser::Recover(size_t start, bool top_level) {
+    if(!m_panic && top_level)
+        Error(D_EXPECTED, "function or module");
+    else if(!m_panic)
+        Error(D_UNKNOWN_STATEMENT);
+    ErrorNode node { start < m_tokens->size() ? m_tokens->offsets[start] : 0 };
+    if(m_pos == start)
+        ReadToken();
+    Synchronize(top_level);
+    return AstNode{node};
+}
+
+void Parser::Synchronize(bool top_level) {
+    m_panic = false;
+
+    //The failed statement may have read its ';' already, or the '}' of the
+    //block where it expected its end
+    if(!top_level && m_pos && m_tokens->kinds[m_pos - 1] == T_PUNCTUATION) {
+        if(m_tokens->ids[m_pos - 1] == P_SEMICOLON)
+            return;
+        if(m_tokens->ids[m_pos - 1] == P_CLOSE_BRACE) {
+            m_pos--;
+            return;
+        }
+    }
+
+    int depth = 0;
+    while(auto token = PeekToken()) {
+        if(depth <= 0 && AtItemKeyword())
+            break;
+        if(token->type() == T_PUNCTUATION) {
+            auto type = token->subtype();
+            if(type == P_OPEN_BRACE)
+                depth++;
+            else if(type == P_CLOSE_BRACE && depth-- <= 0 && !top_level)
+                break;
+            else if(type == P_SEMICOLON && depth <= 0 && !top_level) {
+                ReadToken();
+                break;
+            }
+        }
+        ReadToken();
+    }
+}
+
+// Token ranges of the top level functions of a file, each from its 'fn' to
+// past its closing brace, found by matching braces. None if the file has
+// anything else at the top level or its braces do not match.
+boost::optional<std::vector<std::pair<uint32_t, uint32_t>>> FindTopLevelFunctions(TokenStream const& tokens, size_t first = 0) {
+    std::vector<std::pair<uint32_t, uint32_t>> functions;
+    int depth = 0;
+    bool in_function = false;
+    bool in_body = false;
+    for(uint32_t i = uint32_t(first); i < tokens.size(); ++i) {
+        if(tokens.kinds[i] == T_PUNCTUATION) {
+            if(!in_function)
+                return boost::none;
+            if(tokens.ids[i] == P_OPEN_BRACE) {
+                depth++;
+                in_body = true;
+            }
+            else if(tokens.ids[i] == P_CLOSE_BRACE && --depth == 0) {
+                functions.back().second = i + 1;
+                in_function = in_body = false;
+            }
+        }
+        else if(depth == 0 && !in_function) {
+            if(tokens.kinds[i] != T_NAME || tokens.symbols[i] != S_FN)
+                return boost::none;
+            functions.emplace_back(i, i);
+            in_function = true;
+        }
+        else if(depth == 0 && in_body)
+            return boost::none;
+    }
+    if(in_function)
+        return boost::none;
+    return functions;
+}
+
+// The functions are split into batches of about equal token count, each
+// parsed by a parser of its own into an arena of its own, which is adopted by
+// the arena of this parser afterwards. Only input that parses cleanly is
+// parsed this way: a file with modules or anything else at the top level, or
+// with a function that has an error, is parsed again by ParseFile so the tree
+// and the diagnostics are those of the serial parse.
+boost::optional<AstNode> Parser::ParallelParseFile(const char* filename, unsigned threads) {
+    if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    //Skipping bodies is a scan already
+    if(threads < 2 || m_lazy_bodies)
+        return ParseFile(filename);
+    auto ranges = FindTopLevelFunctions(*m_tokens, m_pos);
+    if(!ranges || ranges->size() < 2)
+        return ParseFile(filename);
+
+    struct Batch {
+        size_t first = 0;       //Index into ranges
+        size_t last = 0;
+        AstArena arena;
+        std::vector<AstNode> functions;
+        bool failed = false;
+    };
+    size_t count = std::min<size_t>(ranges->size(), threads * 8);
+    size_t total = ranges->back().second - ranges->front().first;
+    std::vector<Batch> batches(count);
+    for(size_t i = 0, next = 0; i < count; ++i) {
+        batches[i].first = next;
+        auto target = ranges->front().first + (i + 1) * total / count;
+        while(next < ranges->size() && (i + 1 == count || (*ranges)[next].first < target))
+            next++;
+        batches[i].last = next;
+    }
+
+    ParallelFor(batches.size(), threads, [&](size_t i) {
+        auto& batch = batches[i];
+        Parser parser(*m_tokens, nullptr, &batch.arena);
+        parser.SetHashConsing(m_hash_consing);
+        for(size_t j = batch.first; j < batch.last && !batch.failed; ++j) {
+            parser.m_pos = (*ranges)[j].first;
+            parser.m_end = (*ranges)[j].second;
+            auto function = parser.ParseFunction();
+            batch.failed = !function || parser.ErrorCount() || parser.m_pos != parser.m_end;
+            if(function)
+                batch.functions.push_back(std::move(*function));
+        }
+    });
+
+    for(auto const& batch : batches) {
+        if(batch.failed)
+            return ParseFile(filename);
+    }
+
+    FileNode file = FileNode{};
+    file.name = m_arena->Str(filename);
+    auto functions = Builder<AstNode>();
+    for(auto& batch : batches) {
+        for(auto& function : batch.functions)
+            functions.push_back(std::move(function));
+        m_arena->Adopt(batch.arena);
+    }
+    ModuleNode module;
+    module.functions = functions.List();
+    auto modules = Builder<ModuleNode>();
+    modules.push_back(std::move(module));
+    file.modules = modules.List();
+
+    m_pos = m_end;
+    return AstNode{std::move(file)};
 }
 
 boost::optional<AstNode> Parser::Parse () {
-    return ParseFile("empty");
+    return ParseFile("");
 }
 
 void tab(int depth) {
@@ -702,17 +1295,25 @@ void print_node(LetNode const& node, int depth);
 void print_node(TypeNode const& node, int depth);
 void print_node(AssignNode const& node, int depth) ;
 void print_node(LogicAndNode const& node, int depth);
+void print_node(LogicEqualNode const& node, int depth);
 void print_node(NumberNode const& node, int depth);
 void print_node(StringNode const& node, int depth);
 void print_node(ParameterNode const& node, int depth);
+void print_node(ErrorNode const& node, int depth);
 
 struct print_node_visitor : public boost::static_visitor<> {
     print_node_visitor(int d) : m_depth(d) {}
     template <typename T>
-    void operator()(T node) const { tab(m_depth); print_node(node, m_depth); }
+    void operator()(T const& node) const { tab(m_depth); print_node(node, m_depth); }
     int m_depth;
 };
 
+//Children that are optional, like the right hand side of a let, may be null
+void print_child(AstNode const* node, int depth) {
+    if(node)
+        boost::apply_visitor(print_node_visitor{depth}, *node);
+}
+
 void print_node(FileNode const& node, int depth) {
     std::cout << "File node\n";
 
@@ -737,7 +1338,7 @@ void print_node(FunctionNode const& node, int depth) {
     for(auto& p : node.parameters) {
         tab(depth); print_node(p, depth); 
     }
-    print_node(node.func_body, depth+1);
+    print_node(node.Body(), depth+1);
 }
 
 void print_node(BlockNode const& node, int depth) {
@@ -749,7 +1350,7 @@ void print_node(BlockNode const& node, int depth) {
 
 void print_node(StatementNode const& node, int depth) {
     std::cout << "Statement\n";
-    boost::apply_visitor(print_node_visitor{depth+1}, node.expr);
+    print_child(node.expr, depth+1);
 }
 
 void print_node(EmptyStatementNode const&, int) {
@@ -780,48 +1381,52 @@ void print_node(TypeNode const& node, int) {
 
 void print_node(LetNode const& node, int depth) {
     std::cout << "Let node " << node.var_name << "\n";
-    boost::apply_visitor(print_node_visitor{depth+1}, node.rhs);
-}
-
-void print_node(ExprNode const& node, int depth) {
-    std::cout << "Expression\n";
-    for(auto& op : node.operations) {
-        boost::apply_visitor(print_node_visitor{depth+1}, op);
-    }
+    print_child(node.rhs, depth+1);
 }
 
 void print_node(AddNode const& node, int depth) {
     std::cout << "AddNode\n";
-    boost::apply_visitor(print_node_visitor{depth+1}, node.node);;
+    print_child(node.lhs, depth+1);
+    print_child(node.rhs, depth+1);
 }
 
 void print_node(DecNode  const& node, int depth) {
     std::cout << "DecNode\n";
-    boost::apply_visitor(print_node_visitor{depth+1}, node.node);
+    print_child(node.lhs, depth+1);
+    print_child(node.rhs, depth+1);
 }
 
 void print_node(MulNode  const& node, int depth) {
     std::cout << "MulNode\n";
-    boost::apply_visitor(print_node_visitor{depth+1}, node.node);
+    print_child(node.lhs, depth+1);
+    print_child(node.rhs, depth+1);
 }
 
 void print_node(DivNode  const& node, int depth) {
     std::cout << "DivNode\n";
-    boost::apply_visitor(print_node_visitor{depth+1}, node.node);
+    print_child(node.lhs, depth+1);
+    print_child(node.rhs, depth+1);
 }
 
 void print_node(AssignNode const& node, int depth) {
     std::cout << "Assign node\n";
 
-    boost::apply_visitor(print_node_visitor{depth+1}, node.lhs);
-    boost::apply_visitor(print_node_visitor{depth+1}, node.rhs);
+    print_child(node.lhs, depth+1);
+    print_child(node.rhs, depth+1);
 }
 
 void print_node(LogicAndNode const& node, int depth) {
-    std::cout << "Assign node\n";
+    std::cout << "LogicAnd node\n";
 
-    boost::apply_visitor(print_node_visitor{depth+1}, node.lhs);
-    boost::apply_visitor(print_node_visitor{depth+1}, node.rhs);
+    print_child(node.lhs, depth+1);
+    print_child(node.rhs, depth+1);
+}
+
+void print_node(LogicEqualNode const& node, int depth) {
+    std::cout << "LogicEqual node\n";
+
+    print_child(node.lhs, depth+1);
+    print_child(node.rhs, depth+1);
 }
 
 void print_node(NumberNode const& node, int ) {
@@ -846,6 +1451,10 @@ void print_node(ParameterNode const& node, int ) {
     std::cout << " " << node.name << "\n";
 }
 
+void print_node(ErrorNode const&, int) {
+    std::cout << "Error node\n";
+}
+
 void print_ast(AstNode const& node) {
     boost::apply_visitor(print_node_visitor{0}, node);
 }
@@ -869,11 +1478,15 @@ template<typename T> void visit(FunctionNode const& node, T fn) {
     fn(node);
 }
 
+//A function that failed to parse
+template<typename T> void visit(ErrorNode const& node, T fn) {
+    fn(node);
+}
 
+//Statements and expressions are not visited
 template<typename Tnode, typename Tvisit>
 inline typename std::enable_if<!std::is_same<Tnode, AstNode>::value, void>::type
-visit(Tnode const& node, Tvisit) {
-    std::cout << "shouldnt be here " << typeid(node).name() << "\n";
+visit(Tnode const&, Tvisit) {
 }
 
 template<typename Tnode, typename Tvisit>
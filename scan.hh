@@ -0,0 +1,472 @@
+#ifndef __scan_h__
+#define __scan_h__
+
+// Bulk character scanning used by the lexer to skip whitespace and comments,
+// to validate UTF-8 in names and strings, and to find line starts for the
+// LineTable.
+//
+// The vector paths classify 64-byte blocks into bitmasks and then work on the
+// masks with bit scans. They never read outside the buffer: every scan is
+// given end, the NUL that terminates the buffer, and the last block before it
+// is classified from a zero padded copy. The implementation is picked once at
+// startup from what the cpu supports; scan::Use() overrides it for tests and
+// benchmarks.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_HAVE_X86 1
+#endif
+
+namespace scan {
+
+enum class Isa {
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+inline bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\n'; }
+
+// The scalar scans stop at the NUL on their own and ignore end
+
+const char* SkipSpaceScalar(const char* p, const char*) {
+    while(IsSpace(*p))
+        ++p;
+    return p;
+}
+
+const char* FindLineEndScalar(const char* p, const char*) {
+    while(*p != '\n' && *p != '\0')
+        ++p;
+    return p;
+}
+
+const char* SkipBlockCommentScalar(const char* p, const char*) {
+    bool star = false;
+    for(; *p != '\0'; ++p) {
+        if(*p == '/' && star)
+            return p + 1;
+        star = *p == '*';
+    }
+    return nullptr;
+}
+
+void CollectLineStartsScalar(const char* buffer, const char*, std::vector<uint32_t>& starts) {
+    for(const char* p = buffer; *p != '\0'; ++p) {
+        if(*p == '\n')
+            starts.push_back(uint32_t(p - buffer + 1));
+    }
+}
+
+// Length of the UTF-8 sequence at s if it is valid and ends before end, 0 if
+// not. Overlong forms, surrogates and code points above U+10FFFF are invalid.
+inline size_t Utf8Sequence(const unsigned char* s, const unsigned char* end) {
+    unsigned c = s[0];
+    if(c < 0x80)
+        return 1;
+
+    size_t n;
+    unsigned lo = 0x80, hi = 0xBF;  //Range of the second byte
+    if(c >= 0xC2 && c <= 0xDF)
+        n = 2;
+    else if(c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        if(c == 0xE0)
+            lo = 0xA0;
+        else if(c == 0xED)
+            hi = 0x9F;
+    }
+    else if(c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        if(c == 0xF0)
+            lo = 0x90;
+        else if(c == 0xF4)
+            hi = 0x8F;
+    }
+    else
+        return 0;
+
+    if(size_t(end - s) < n || s[1] < lo || s[1] > hi)
+        return 0;
+    for(size_t i = 2; i < n; ++i) {
+        if((s[i] & 0xC0) != 0x80)
+            return 0;
+    }
+    return n;
+}
+
+bool ValidUtf8Scalar(const char* p, size_t len) {
+    auto s = reinterpret_cast<const unsigned char*>(p);
+    auto end = s + len;
+    while(s < end) {
+        size_t n = Utf8Sequence(s, end);
+        if(!n)
+            return false;
+        s+= n;
+    }
+    return true;
+}
+
+#ifdef SCAN_HAVE_X86
+struct Masks {
+    uint64_t space;     // ' ', '\t' and '\n'
+    uint64_t newline;   // '\n'
+    uint64_t nul;       // '\0'
+    uint64_t star;      // '*'
+    uint64_t slash;     // '/'
+};
+
+struct Sse2 {
+    static uint64_t Eq(__m128i const* v, char c) {
+        __m128i k = _mm_set1_epi8(c);
+        uint64_t result = 0;
+        for(int i = 0; i < 4; ++i)
+            result |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], k)))) << (i * 16);
+        return result;
+    }
+
+    static void Classify(const char* block, Masks& masks) {
+        __m128i v[4];
+        for(int i = 0; i < 4; ++i)
+            v[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i * 16));
+
+        masks.newline = Eq(v, '\n');
+        masks.space = Eq(v, ' ') | Eq(v, '\t') | masks.newline;
+        masks.nul = Eq(v, '\0');
+        masks.star = Eq(v, '*');
+        masks.slash = Eq(v, '/');
+    }
+};
+
+struct Avx2 {
+    __attribute__((target("avx2")))
+    static uint64_t Eq(__m256i lo, __m256i hi, char c) {
+        __m256i k = _mm256_set1_epi8(c);
+        uint64_t l = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, k)));
+        uint64_t h = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, k)));
+        return l | (h << 32);
+    }
+
+    __attribute__((target("avx2")))
+    static void Classify(const char* block, Masks& masks) {
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+
+        masks.newline = Eq(lo, hi, '\n');
+        masks.space = Eq(lo, hi, ' ') | Eq(lo, hi, '\t') | masks.newline;
+        masks.nul = Eq(lo, hi, '\0');
+        masks.star = Eq(lo, hi, '*');
+        masks.slash = Eq(lo, hi, '/');
+    }
+};
+
+//Bits below bit n
+inline uint64_t Below(int n) { return n == 0 ? 0 : ~uint64_t(0) >> (64 - n); }
+
+// Classifies the 64 bytes at block, end is the NUL of the buffer. A block
+// that would reach past end is copied first, its padding reads as NUL, so
+// every scan stops in it at the latest.
+template<typename V>
+inline void ClassifyBlock(const char* block, const char* end, Masks& masks) {
+    if(end - block >= 64) {
+        V::Classify(block, masks);
+        return;
+    }
+    alignas(64) char tail[64] = {};
+    std::memcpy(tail, block, size_t(end - block));
+    V::Classify(tail, masks);
+}
+
+// The block algorithms are instantiated inside the target specific wrappers
+// below so that they inline the classifier and use the wider instructions.
+template<typename V>
+inline const char* SkipSpaceBlocks(const char* p, const char* end) {
+    for(const char* block = p;; block += 64) {
+        Masks m;
+        ClassifyBlock<V>(block, end, m);
+        if(~m.space)
+            return block + __builtin_ctzll(~m.space);
+    }
+}
+
+template<typename V>
+inline const char* FindLineEndBlocks(const char* p, const char* end) {
+    for(const char* block = p;; block += 64) {
+        Masks m;
+        ClassifyBlock<V>(block, end, m);
+        uint64_t stop = m.newline | m.nul;
+        if(stop)
+            return block + __builtin_ctzll(stop);
+    }
+}
+
+template<typename V>
+inline const char* SkipBlockCommentBlocks(const char* p, const char* end) {
+    uint64_t carry = 0; //Star in the last byte of the previous block
+    for(const char* block = p;; block += 64) {
+        Masks m;
+        ClassifyBlock<V>(block, end, m);
+        uint64_t close = ((m.star << 1) | carry) & m.slash;
+        uint64_t stop = close | m.nul;
+        if(stop) {
+            int pos = __builtin_ctzll(stop);
+            if(close & (uint64_t(1) << pos))
+                return block + pos + 1;
+            return nullptr;
+        }
+        carry = m.star >> 63;
+    }
+}
+
+template<typename V>
+inline void CollectLineStartsBlocks(const char* buffer, const char* end, std::vector<uint32_t>& starts) {
+    for(const char* block = buffer;; block += 64) {
+        Masks m;
+        ClassifyBlock<V>(block, end, m);
+        uint64_t newlines = m.newline;
+        if(m.nul)
+            newlines &= Below(__builtin_ctzll(m.nul));
+
+        for(; newlines; newlines &= newlines - 1)
+            starts.push_back(uint32_t(block + __builtin_ctzll(newlines) - buffer + 1));
+
+        if(m.nul)
+            return;
+    }
+}
+
+// UTF-8 validation works on a span instead of a NUL terminated buffer, the
+// spans are short and not aligned so it uses unaligned loads and handles the
+// tail in a zero padded copy.
+
+// SSE2 has no byte shuffle, so it only skips runs of ASCII 16 bytes at a time
+// and checks the other sequences one by one
+bool ValidUtf8Sse2(const char* p, size_t len) {
+    auto s = reinterpret_cast<const unsigned char*>(p);
+    auto end = s + len;
+    while(s < end) {
+        if(*s < 0x80 && end - s >= 16) {
+            unsigned high = unsigned(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s))));
+            s+= high ? __builtin_ctz(high) : 16;
+            continue;
+        }
+        size_t n = Utf8Sequence(s, end);
+        if(!n)
+            return false;
+        s+= n;
+    }
+    return true;
+}
+
+// The lookup algorithm of Keiser and Lemire, "Validating UTF-8 in less than
+// one instruction per byte". Every byte is checked together with the three
+// before it: three table lookups on the high and low nibble of the previous
+// byte and the high nibble of the byte itself flag every invalid two byte
+// combination, and saturating subtracts on the bytes two and three back
+// tell where a third or fourth byte of a sequence is required.
+struct Utf8Avx2 {
+    enum : uint8_t {
+        TooShort = 1 << 0,      // 11______ 0_______ or 11______ 11______
+        TooLong = 1 << 1,       // 0_______ 10______
+        Overlong3 = 1 << 2,     // 11100000 100_____
+        TooLarge = 1 << 3,      // 11110100 1001____ and above
+        Surrogate = 1 << 4,     // 11101101 101_____
+        Overlong2 = 1 << 5,     // 1100000_ 10______
+        TooLarge1000 = 1 << 6,  // 11110101+ 1000____
+        Overlong4 = 1 << 6,     // 11110000 1000____
+        TwoConts = 1 << 7,      // 10______ 10______
+        Carry = TooShort | TooLong | TwoConts
+    };
+
+    static constexpr uint8_t byte_1_high[16] = {
+        TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+        TwoConts, TwoConts, TwoConts, TwoConts,
+        TooShort | Overlong2,
+        TooShort,
+        TooShort | Overlong3 | Surrogate,
+        TooShort | TooLarge | TooLarge1000 | Overlong4
+    };
+    static constexpr uint8_t byte_1_low[16] = {
+        Carry | Overlong3 | Overlong2 | Overlong4,
+        Carry | Overlong2,
+        Carry,
+        Carry,
+        Carry | TooLarge,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000 | Surrogate,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000
+    };
+    static constexpr uint8_t byte_2_high[16] = {
+        TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooShort, TooShort, TooShort, TooShort
+    };
+
+    __attribute__((target("avx2")))
+    static __m256i Lookup(uint8_t const (&table)[16], __m256i nibbles) {
+        __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table));
+        return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(t), nibbles);
+    }
+
+    //Checks the 32 bytes of input, prev holds the 32 before them
+    __attribute__((target("avx2")))
+    static void Check(__m256i input, __m256i& prev, __m256i& incomplete, __m256i& error) {
+        if(_mm256_testz_si256(input, _mm256_set1_epi8(char(0x80)))) {
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+            prev = input;
+            return;
+        }
+
+        __m256i low = _mm256_set1_epi8(0x0F);
+        __m256i shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+        __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+        __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+        __m256i special = _mm256_and_si256(
+            _mm256_and_si256(Lookup(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low)),
+                             Lookup(byte_1_low, _mm256_and_si256(prev1, low))),
+            Lookup(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), low)));
+
+        //Only 111_____ and 1111____ stay at or above 0x80
+        __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80)));
+        __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80)));
+        __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(char(0x80)));
+        error = _mm256_or_si256(error, _mm256_xor_si256(must_continue, special));
+
+        //A sequence starting in the last three bytes goes on in the next block
+        __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+        incomplete = _mm256_subs_epu8(input, max);
+        prev = input;
+    }
+};
+
+__attribute__((target("avx2")))
+bool ValidUtf8Avx2(const char* p, size_t len) {
+    __m256i prev = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for(; i + 32 <= len; i+= 32)
+        Utf8Avx2::Check(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)), prev, incomplete, error);
+
+    //The padding is ASCII, so a sequence cut off by the end shows up as too short
+    alignas(32) char tail[32] = {};
+    std::memcpy(tail, p + i, len - i);
+    Utf8Avx2::Check(_mm256_load_si256(reinterpret_cast<const __m256i*>(tail)), prev, incomplete, error);
+    return _mm256_testz_si256(error, error);
+}
+
+const char* SkipSpaceSse2(const char* p, const char* end) { return SkipSpaceBlocks<Sse2>(p, end); }
+const char* FindLineEndSse2(const char* p, const char* end) { return FindLineEndBlocks<Sse2>(p, end); }
+const char* SkipBlockCommentSse2(const char* p, const char* end) { return SkipBlockCommentBlocks<Sse2>(p, end); }
+void CollectLineStartsSse2(const char* buffer, const char* end, std::vector<uint32_t>& starts) {
+    CollectLineStartsBlocks<Sse2>(buffer, end, starts);
+}
+
+__attribute__((target("avx2,bmi")))
+const char* SkipSpaceAvx2(const char* p, const char* end) { return SkipSpaceBlocks<Avx2>(p, end); }
+__attribute__((target("avx2,bmi")))
+const char* FindLineEndAvx2(const char* p, const char* end) { return FindLineEndBlocks<Avx2>(p, end); }
+__attribute__((target("avx2,bmi")))
+const char* SkipBlockCommentAvx2(const char* p, const char* end) { return SkipBlockCommentBlocks<Avx2>(p, end); }
+__attribute__((target("avx2,bmi")))
+void CollectLineStartsAvx2(const char* buffer, const char* end, std::vector<uint32_t>& starts) {
+    CollectLineStartsBlocks<Avx2>(buffer, end, starts);
+}
+#endif
+
+struct Impl {
+    Isa isa;
+    const char* (*skip_space)(const char* p, const char* end);
+    const char* (*find_line_end)(const char* p, const char* end);
+    const char* (*skip_block_comment)(const char* p, const char* end);
+    void (*collect_line_starts)(const char* buffer, const char* end, std::vector<uint32_t>& starts);
+    bool (*valid_utf8)(const char* p, size_t len);
+};
+
+Isa Best() {
+#ifdef SCAN_HAVE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi"))
+        return Isa::Avx2;
+    if(__builtin_cpu_supports("sse2"))
+        return Isa::Sse2;
+#endif
+    return Isa::Scalar;
+}
+
+Impl ImplFor(Isa isa) {
+#ifdef SCAN_HAVE_X86
+    if(isa == Isa::Avx2)
+        return Impl { isa, SkipSpaceAvx2, FindLineEndAvx2, SkipBlockCommentAvx2, CollectLineStartsAvx2, ValidUtf8Avx2 };
+    if(isa == Isa::Sse2)
+        return Impl { isa, SkipSpaceSse2, FindLineEndSse2, SkipBlockCommentSse2, CollectLineStartsSse2, ValidUtf8Sse2 };
+#endif
+    return Impl { Isa::Scalar, SkipSpaceScalar, FindLineEndScalar, SkipBlockCommentScalar, CollectLineStartsScalar, ValidUtf8Scalar };
+}
+
+Impl impl = ImplFor(Best());
+
+//Select the implementation, returns false if the cpu does not support it
+bool Use(Isa isa) {
+    if(isa > Best())
+        return false;
+    impl = ImplFor(isa);
+    return true;
+}
+
+// In the scans below end points to the NUL that terminates the buffer, no
+// byte past it is read.
+
+// Skips spaces, tabs and newlines starting at p and returns the first other
+// character
+inline const char* SkipSpace(const char* p, const char* end) {
+    //Most runs are a few spaces between tokens, don't bother with vectors for those
+    for(int i = 0; i < 8; ++i, ++p) {
+        if(!IsSpace(*p))
+            return p;
+    }
+    return impl.skip_space(p, end);
+}
+
+// Returns the first '\n' or '\0' at or after p
+inline const char* FindLineEnd(const char* p, const char* end) {
+    return impl.find_line_end(p, end);
+}
+
+// p points just past the opening "/*" of a block comment. Returns the
+// character after the closing "*/", or nullptr if the buffer ends inside the
+// comment.
+inline const char* SkipBlockComment(const char* p, const char* end) {
+    return impl.skip_block_comment(p, end);
+}
+
+// Appends the offset of every character following a '\n' in the buffer
+inline void CollectLineStarts(const char* buffer, const char* end, std::vector<uint32_t>& starts) {
+    impl.collect_line_starts(buffer, end, starts);
+}
+
+// Whether the len bytes at p are well formed UTF-8
+inline bool ValidUtf8(const char* p, size_t len) {
+    return impl.valid_utf8(p, len);
+}
+
+} //namespace scan
+
+#endif //__scan_h__
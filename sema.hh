@@ -3,14 +3,14 @@
 
 #include "expected.hh"
 
-const char* reserved[] = {
-    "fn",
-    "module",
-    "if",
-    "let",
-    "return",
-    "void",
-    "int"
+const uint32_t reserved[] = {
+    S_FN,
+    S_MODULE,
+    S_IF,
+    S_LET,
+    S_RETURN,
+    S_VOID,
+    S_INT
 };
 
 struct ReservedKeyword { std::string keyword; };
@@ -25,7 +25,8 @@ using Result = nonstd::expected<SymbolTable::Category, SemaError>;
 
 class Sema {
 public:
-    Sema(AstNode& node, SymbolTable& sym) : m_ast(node), m_sym(sym) {}
+    Sema(AstNode& node, SymbolTable& sym) : m_ast(&node), m_sym(sym) {}
+    Sema(FlatAst const& ast, SymbolTable& sym) : m_flat_ast(&ast), m_sym(sym) {}
 
     Result Analyse();
 
@@ -39,23 +40,38 @@ protected:
     Result Analysis(LetNode const&, SymbolPath path);
     Result Analysis(TypeNode const&, SymbolPath path);
     Result Analysis(NumberNode const& nn, SymbolPath);
-	Result Analysis(ExprNode const&, SymbolPath path);
 	Result Analysis(IdentifierNode const&, SymbolPath path);
-
-    bool LegalSymbolName(const std::string& name);
+    Result Analysis(AddNode const& node, SymbolPath path) { return Binary(node.lhs, node.rhs, path); }
+    Result Analysis(DecNode const& node, SymbolPath path) { return Binary(node.lhs, node.rhs, path); }
+    Result Analysis(MulNode const& node, SymbolPath path) { return Binary(node.lhs, node.rhs, path); }
+    Result Analysis(DivNode const& node, SymbolPath path) { return Binary(node.lhs, node.rhs, path); }
+    Result Analysis(LogicAndNode const& node, SymbolPath path) { return Binary(node.lhs, node.rhs, path); }
+    Result Analysis(LogicEqualNode const& node, SymbolPath path) { return Binary(node.lhs, node.rhs, path); }
+    //The first error of the operands, or the category of the left one
+    Result Binary(AstNode const* lhs, AstNode const* rhs, SymbolPath path);
+    //The same checks over a FlatAst, node is an index into it
+    Result Analysis(FlatAst const& ast, uint32_t node, SymbolPath path);
+
+    //Gives the variable var_name the category of its initializer
+    Result Define(Symbol var_name, Result const& rhs_result);
+
+    bool LegalSymbolName(Symbol name);
 
     template<typename T>
     Result Analysis(T const&, SymbolPath) {
         return SymbolTable::Category{SymbolTable::Variable{}};
     }
 
-    AstNode& m_ast;
+    AstNode const* m_ast = nullptr;
+    FlatAst const* m_flat_ast = nullptr;
     SymbolTable& m_sym;
 };
 
 Result Sema::Analyse()
 {
-	auto ai = Analysis(m_ast, SymbolPath{});
+	if(m_flat_ast)
+		return Analysis(*m_flat_ast, 0, SymbolPath{});
+	auto ai = Analysis(*m_ast, SymbolPath{});
 	return ai;
 }
 
@@ -101,7 +117,7 @@ Result Sema::Analysis(FunctionNode const& node, SymbolPath path)
         Analysis(param.type, path);
         if(!LegalSymbolName(param.name)) {
 			//Parameters are not allowed to be named reserved keywords
-			return nonstd::make_unexpected(ReservedKeyword{ param.name } );
+			return nonstd::make_unexpected(ReservedKeyword{ param.name.str() } );
         }
     }
 
@@ -109,7 +125,7 @@ Result Sema::Analysis(FunctionNode const& node, SymbolPath path)
 		//Invalid function return type
 		return nonstd::make_unexpected(InvalidFunctionReturnType{ "test" });
     }
-    return Analysis(node.func_body, path);
+    return Analysis(node.Body(), path);
 }
 
 Result Sema::Analysis(BlockNode const& node, SymbolPath path) {
@@ -124,30 +140,40 @@ Result Sema::Analysis(BlockNode const& node, SymbolPath path) {
 
 Result Sema::Analysis(StatementNode const& node, SymbolPath path)
 {
-    return Analysis(node.expr, path);
+    if(!node.expr)
+        return SymbolTable::Category{SymbolTable::Variable{}};
+    return Analysis(*node.expr, path);
 }
 
 Result Sema::Analysis(LetNode const& node, SymbolPath path)
 {
     if(!LegalSymbolName(node.var_name)) {
-		return nonstd::make_unexpected(ReservedKeyword{ node.var_name });
+		return nonstd::make_unexpected(ReservedKeyword{ node.var_name.str() });
     }
 
-    auto rhs_result = Analysis(node.rhs, path);
+    Result rhs_result = SymbolTable::Category{SymbolTable::Variable{}};
+    if(node.rhs) {
+		rhs_result = Analysis(*node.rhs, path);
+    }
 	if (!rhs_result) {
 		return rhs_result;
 	}
 
-    auto symbols = m_sym.Lookup(node.var_name);
+    return Define(node.var_name, rhs_result);
+}
+
+Result Sema::Define(Symbol var_name, Result const& rhs_result)
+{
+    auto symbols = m_sym.Lookup(var_name);
     if(!symbols) {
-		return nonstd::make_unexpected(UndefinedSymbol{ node.var_name });
+		return nonstd::make_unexpected(UndefinedSymbol{ var_name.str() });
     }
 
     auto sym_it = symbols->begin();
     SymbolTable::Entry* sym_ptr = *sym_it;
     SymbolTable::Variable* var;
     if(!(var = boost::get<SymbolTable::Variable>(&sym_ptr->category))) {
-		return nonstd::make_unexpected(InvalidSymbol{ node.var_name });
+		return nonstd::make_unexpected(InvalidSymbol{ var_name.str() });
     }
 
     return boost::apply_visitor(boost::hana::overload(
@@ -156,7 +182,7 @@ Result Sema::Analysis(LetNode const& node, SymbolPath path)
             return rhs_result;
         },
         [&](auto const&) -> Result {
-			return nonstd::make_unexpected(SymbolAlreadyDefined{ node.var_name });
+			return nonstd::make_unexpected(SymbolAlreadyDefined{ var_name.str() });
         }), var->type);
 }
 
@@ -168,7 +194,7 @@ Result Sema::Analysis(TypeNode const& tn, SymbolPath path) {
         },
         [this](NamedType const& nt) -> Result{
             if(!m_sym.Lookup(nt.name)) {
-				return nonstd::make_unexpected(InvalidSymbol{ nt.name });
+				return nonstd::make_unexpected(InvalidSymbol{ nt.name.str() });
             }
             return SymbolTable::Category{
                 SymbolTable::Variable{
@@ -185,40 +211,125 @@ Result Sema::Analysis(NumberNode const& nn, SymbolPath) {
 }
 
 
-Result Sema::Analysis(ExprNode const& en, SymbolPath path)
+Result Sema::Binary(AstNode const* lhs, AstNode const* rhs, SymbolPath path)
 {
-	Result result;
-	boost::optional<SymbolTable::Category> category;
-
-	for (const auto& op : en.operations) {
-		result = Analysis(op, path);
-		if (!result)
-			return result;
-		if (!category)
-			category = *result;
-		else if()
-	}
-	return result;
-}
-
-Result Sema::Analysis(AddNode const& an, SymbolPath path) {
-	return Analysis(an, path);
+    Result result = SymbolTable::Category{SymbolTable::Variable{}};
+    if(lhs)
+        result = Analysis(*lhs, path);
+    if(!result || !rhs)
+        return result;
+
+    auto rhs_result = Analysis(*rhs, path);
+    if(!rhs_result)
+        return rhs_result;
+    return result;
 }
 
 Result Sema::Analysis(IdentifierNode const& in, SymbolPath path)
 {
 	auto lookup = m_sym.Lookup(in.identifier);
 	if (!lookup)
-		return nonstd::make_unexpected(UndefinedSymbol{ in.identifier });
+		return nonstd::make_unexpected(UndefinedSymbol{ in.identifier.str() });
 
 	auto& result = *lookup;
 	return result[0]->category;
 }
 
-bool Sema::LegalSymbolName(std::string const& name)
+Result Sema::Analysis(FlatAst const& ast, uint32_t node, SymbolPath path)
+{
+    auto child = ast.first_child[node];
+    auto next = [&ast](uint32_t i) { return ast.next_sibling[i]; };
+
+    switch(ast.kinds[node]) {
+    case F_FILE: {
+        Result result = SymbolTable::Category{SymbolTable::File{}};
+        for(; child != FlatAst::none; child = next(child)) {
+            auto ai = Analysis(ast, child, path);
+            if(!ai)
+                result = ai;
+        }
+        return result;
+    }
+    case F_MODULE: {
+        Result result = SymbolTable::Category{SymbolTable::Module{}};
+        if(ast.flags[node] & F_HAS_NAME)
+            path.emplace_back(ast.Name(node));
+        for(; child != FlatAst::none; child = next(child)) {
+            auto ai = Analysis(ast, child, path);
+            if(!ai)
+                result = ai;
+        }
+        return result;
+    }
+    case F_FUNCTION: {
+        path.emplace_back(ast.Name(node));
+
+        //Return type, parameters and body
+        auto return_type = child;
+        for(child = next(child); ast.kinds[child] == F_PARAMETER; child = next(child)) {
+            Analysis(ast, ast.first_child[child], path);
+            if(!LegalSymbolName(ast.Name(child)))
+                return nonstd::make_unexpected(ReservedKeyword{ ast.Name(child).str() });
+        }
+
+        if(!Analysis(ast, return_type, path))
+            return nonstd::make_unexpected(InvalidFunctionReturnType{ "test" });
+        return Analysis(ast, child, path);
+    }
+    case F_BLOCK: {
+        Result last_result = nonstd::make_unexpected(InvalidBlock{});
+        for(; child != FlatAst::none; child = next(child)) {
+            last_result = Analysis(ast, child, path);
+            if(!last_result)
+                return last_result;
+        }
+        return last_result;
+    }
+    case F_STATEMENT:
+        if(child == FlatAst::none)
+            return SymbolTable::Category{SymbolTable::Variable{}};
+        return Analysis(ast, child, path);
+    case F_LET: {
+        if(!LegalSymbolName(ast.Name(node)))
+            return nonstd::make_unexpected(ReservedKeyword{ ast.Name(node).str() });
+
+        Result rhs_result = SymbolTable::Category{SymbolTable::Variable{}};
+        if(child != FlatAst::none)
+            rhs_result = Analysis(ast, child, path);
+        if(!rhs_result)
+            return rhs_result;
+        return Define(ast.Name(node), rhs_result);
+    }
+    case F_TYPE:
+        if(ast.flags[node] & F_NAMED_TYPE)
+            return Analysis(TypeNode{NamedType{ast.Name(node)}}, path);
+        return Analysis(TypeNode{SimpleType(ast.payloads[node])}, path);
+    case F_NUMBER:
+        return Analysis(NumberNode{ast.Number(node)}, path);
+    case F_ADD: case F_DEC: case F_MUL: case F_DIV: case F_LOGIC_AND: case F_LOGIC_EQUAL: {
+        Result result = SymbolTable::Category{SymbolTable::Variable{}};
+        if(child == FlatAst::none)
+            return result;
+        result = Analysis(ast, child, path);
+        if(!result || next(child) == FlatAst::none)
+            return result;
+
+        auto rhs_result = Analysis(ast, next(child), path);
+        if(!rhs_result)
+            return rhs_result;
+        return result;
+    }
+    case F_IDENTIFIER:
+        return Analysis(IdentifierNode{ast.Name(node)}, path);
+    default:
+        return SymbolTable::Category{SymbolTable::Variable{}};
+    }
+}
+
+bool Sema::LegalSymbolName(Symbol name)
 {
-    for(auto const& r : reserved) {
-        if(name == r)
+    for(auto r : reserved) {
+        if(name.id == r)
             return false;
     }
     return true;
@@ -0,0 +1,165 @@
+#ifndef __source_h__
+#define __source_h__
+
+// Owns the source buffers handed to the Lexer and gives each a FileId.
+//
+// Files are memory mapped read-only and shared with the page cache instead of
+// being copied. The lexer relies on a '\0' after the last character, so the
+// mapping is placed at the start of a zero-filled anonymous reservation that
+// is at least one byte longer than the file: the rest of the last file page
+// and the reserved page after it read as zeros. Buffers stay valid until the
+// SourceManager is destroyed.
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SOURCE_HAVE_MMAP 1
+#else
+#include <fstream>
+#include <sstream>
+#endif
+
+typedef uint32_t FileId;
+
+// 1-based line and column (in bytes) of a source offset
+struct Location {
+    uint32_t line;
+    uint32_t column;
+};
+
+// Start offsets of every line in a buffer, so tokens and nodes only need to
+// keep a byte offset. Built with one vectorized scan for newlines, resolving
+// an offset is a binary search.
+class LineTable {
+public:
+    LineTable() { m_starts.push_back(0); }
+    explicit LineTable(const char* buffer) : LineTable(buffer, std::strlen(buffer)) { }
+    LineTable(const char* buffer, size_t size) : LineTable() { scan::CollectLineStarts(buffer, buffer + size, m_starts); }
+
+    Location Resolve(uint32_t offset) const {
+        auto it = std::upper_bound(m_starts.begin(), m_starts.end(), offset);
+        auto line = uint32_t(it - m_starts.begin());
+        return Location { line, offset - m_starts[line - 1] + 1 };
+    }
+
+    size_t LineCount() const { return m_starts.size(); }
+
+protected:
+    std::vector<uint32_t> m_starts;
+};
+
+class SourceManager {
+public:
+    SourceManager() = default;
+    SourceManager(SourceManager const&) = delete;
+    SourceManager& operator=(SourceManager const&) = delete;
+    ~SourceManager();
+
+    boost::optional<FileId> Load(std::string const& path);
+    FileId Add(std::string const& name, std::string contents);
+
+    const char* Buffer(FileId id) const { return m_files[id].data; }
+    size_t Size(FileId id) const { return m_files[id].size; }
+    std::string const& Name(FileId id) const { return m_files[id].name; }
+    LineTable const& Lines(FileId id) const;
+    size_t FileCount() const { return m_files.size(); }
+
+    std::string const& ErrorMessage() const { return m_error; }
+
+protected:
+    struct File {
+        std::string name;
+        const char* data = nullptr;
+        size_t size = 0;
+        size_t mapped_size = 0;     //Zero unless data is a mapping we own
+        std::unique_ptr<std::string> owned;
+        mutable std::unique_ptr<LineTable> lines;   //Built on first use
+    };
+
+    boost::optional<FileId> Error(std::string const& error_string) { m_error = error_string; return boost::none; }
+
+    std::vector<File> m_files;
+    std::string m_error;
+};
+
+SourceManager::~SourceManager() {
+#ifdef SOURCE_HAVE_MMAP
+    for(auto& file : m_files) {
+        if(file.mapped_size)
+            munmap(const_cast<char*>(file.data), file.mapped_size);
+    }
+#endif
+}
+
+LineTable const& SourceManager::Lines(FileId id) const {
+    auto& file = m_files[id];
+    if(!file.lines)
+        file.lines = std::make_unique<LineTable>(file.data, file.size);
+    return *file.lines;
+}
+
+FileId SourceManager::Add(std::string const& name, std::string contents) {
+    File file;
+    file.name = name;
+    file.owned = std::make_unique<std::string>(std::move(contents));
+    file.data = file.owned->c_str();
+    file.size = file.owned->size();
+    m_files.push_back(std::move(file));
+    return FileId(m_files.size() - 1);
+}
+
+boost::optional<FileId> SourceManager::Load(std::string const& path) {
+#ifdef SOURCE_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return Error("Unable to open " + path);
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return Error("Not a regular file " + path);
+    }
+
+    size_t size = size_t(st.st_size);
+    if(size >= UINT32_MAX) {    //Token offsets are 32-bit
+        close(fd);
+        return Error("File too large " + path);
+    }
+
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t mapped_size = (size / page + 1) * page;
+
+    void* base = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+        close(fd);
+        return Error("Unable to map " + path);
+    }
+
+    if(size && mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, mapped_size);
+        close(fd);
+        return Error("Unable to map " + path);
+    }
+    close(fd);
+
+    File file;
+    file.name = path;
+    file.data = static_cast<const char*>(base);
+    file.size = size;
+    file.mapped_size = mapped_size;
+    m_files.push_back(std::move(file));
+    return FileId(m_files.size() - 1);
+#else
+    std::ifstream in(path, std::ios::binary);
+    if(!in)
+        return Error("Unable to open " + path);
+
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return Add(path, contents.str());
+#endif
+}
+
+#endif //__source_h__
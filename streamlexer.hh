@@ -0,0 +1,156 @@
+#ifndef __streamlexer_h__
+#define __streamlexer_h__
+
+// Lexes input that arrives in blocks, from a pipe or from sources too large
+// to hold in memory. Tokens are handed to the sink as soon as they are known
+// to be complete, with their text and their offset in the stream, and the
+// text they came from is dropped. Only an unfinished token at the end of a
+// block is carried over to the next one; comments are skipped as they
+// arrive, so memory is bounded by the block size plus the longest token.
+//
+// The tokens are the ones Tokenize() would produce for the whole input, and
+// lexing stops at the same errors. token.offset holds the low 32 bits of the
+// stream offset, the sink gets the full offset separately.
+class StreamLexer {
+public:
+    typedef std::function<void(Token const& token, std::string_view text, uint64_t offset)> Sink;
+
+    explicit StreamLexer(Sink sink) : m_sink(std::move(sink)) { }
+
+    //Lexes the next block of input, a '\0' ends the input like it does for Lexer
+    void Feed(std::string_view data);
+    //No more input, emits the token that was held back
+    void Finish();
+
+    bool Done() const { return m_done; }
+    size_t Buffered() const { return m_pending.size(); }
+
+    DiagnosticCode ErrorCode() const { return m_error; }
+    std::string_view ErrorMessage() const { return diagnostic_infos[m_error].format; }
+    uint64_t ErrorOffset() const { return m_error_offset; }
+    //Errors are reported with the low 32 bits of their stream offset
+    void SetDiagnostics(Diagnostics* diagnostics) { m_diagnostics = diagnostics; }
+
+protected:
+    enum class State {
+        Code,
+        LineComment,
+        BlockComment
+    };
+
+    void Lex(bool last);
+
+    Sink m_sink;
+    std::string m_pending;      //Input not consumed yet, starts in m_state
+    uint64_t m_base = 0;        //Stream offset of m_pending[0]
+    State m_state = State::Code;
+    bool m_star = false;        //The block comment read so far ends with '*'
+    bool m_done = false;
+
+    DiagnosticCode m_error = D_NONE;
+    uint64_t m_error_offset = 0;
+    Diagnostics* m_diagnostics = nullptr;
+};
+
+void StreamLexer::Feed(std::string_view data) {
+    if(m_done)
+        return;
+
+    auto nul = data.find('\0');
+    bool last = nul != std::string_view::npos;
+    m_pending.append(data.substr(0, nul));
+    Lex(last);
+    m_done = m_done || last;
+}
+
+void StreamLexer::Finish() {
+    if(m_done)
+        return;
+    Lex(true);
+    m_done = true;
+}
+
+void StreamLexer::Lex(bool last) {
+    const char* buf = m_pending.c_str();
+    size_t size = m_pending.size();
+    size_t pos = 0;
+
+    while(!m_done) {
+        if(m_state == State::LineComment) {
+            pos = scan::FindLineEnd(buf + pos, buf + size) - buf;
+            if(pos == size)
+                break;
+            m_state = State::Code;
+        }
+        else if(m_state == State::BlockComment) {
+            if(m_star && buf[pos] == '/') {
+                m_star = false;
+                m_state = State::Code;
+                pos++;
+                continue;
+            }
+
+            auto end = scan::SkipBlockComment(buf + pos, buf + size);
+            if(!end) {
+                if(size > pos)
+                    m_star = buf[size - 1] == '*';
+                pos = size;
+                break;
+            }
+            pos = end - buf;
+            m_star = false;
+            m_state = State::Code;
+        }
+        else {
+            char c = buf[pos];
+            if(scan::IsSpace(c)) {
+                pos = scan::SkipSpace(buf + pos, buf + size) - buf;
+                continue;
+            }
+            if(c == '/' && buf[pos + 1] == '/') {
+                m_state = State::LineComment;
+                pos+= 2;
+                continue;
+            }
+            if(c == '/' && buf[pos + 1] == '*') {
+                m_state = State::BlockComment;
+                m_star = false;
+                pos+= 2;
+                continue;
+            }
+            if(c == '\0' || (c == '/' && pos + 1 == size && !last))
+                break;
+
+            Lexer lex(buf, uint32_t(pos), size);
+            lex.Silence();
+            auto token = lex.ReadToken();
+            size_t end = lex.Offset();
+            if(end >= size && !last)
+                break;  //Could go on in the next block, lex it again then
+
+            if(lex.ErrorCode() != D_NONE) {
+                m_error = lex.ErrorCode();
+                m_error_offset = m_base + lex.ErrorOffset();
+                if(m_diagnostics)
+                    m_diagnostics->Report(m_error, uint32_t(m_error_offset));
+            }
+            if(!token) {
+                m_done = true;
+                break;
+            }
+
+            uint64_t offset = m_base + token->offset;
+            auto text = token->data_view(buf);
+            token->offset = uint32_t(offset);
+            m_sink(*token, text, offset);
+            pos = end;
+        }
+    }
+
+    if(m_done)
+        pos = size;
+    m_pending.erase(0, pos);
+    m_base+= pos;
+}
+
+#endif //__streamlexer_h__
@@ -1,14 +1,19 @@
 #ifndef __SYMBOLTABLE_HH__
 #define __SYMBOLTABLE_HH__
 
-using SymbolPath = std::vector<std::string>;
+using SymbolPath = std::vector<Symbol>;
 
 class SymbolTable {
 public:
-    SymbolTable(AstNode& root) : m_root_ast_node(root) {}
+    SymbolTable(AstNode& root) : m_root_ast_node(&root) {}
+    SymbolTable(FlatAst const& root) : m_root_flat_ast(&root) {}
 
     void Generate();
+    // Only modules, functions and their parameters, without looking into the
+    // function bodies, which are not parsed when they are lazy
+    void GenerateDeclarations();
     void Generate(AstNode const& node, SymbolPath = SymbolPath {} );
+    void Generate(FlatAst const& ast);
 
     struct Auto {};
 
@@ -19,7 +24,7 @@ public:
     };
 
     struct UserDefinedType {
-        std::string name;
+        Symbol name;
     };
 
     using Type = boost::variant<
@@ -43,45 +48,60 @@ public:
 
 
     struct Entry {
-        int line;
-        int column;
+        uint32_t offset = 0;    //Resolve with a LineTable
         Category category;
         SymbolPath path;
         AstNode const* node_ptr = nullptr;
+        uint32_t flat_node = FlatAst::none;    //Index of the node when made from a FlatAst
     };
 
-    boost::optional<std::vector<Entry*>> Lookup(const char* symbol);
-    boost::optional<std::vector<Entry*>> Lookup(const std::string& symbol);
+    boost::optional<std::vector<Entry*>> Lookup(Symbol symbol);
+    //A name that was never interned is in no table, so it is not interned either
+    boost::optional<std::vector<Entry*>> Lookup(std::string_view name);
 
-    using SymbolMap = std::multimap<std::string, Entry>;
+    using SymbolMap = std::multimap<Symbol, Entry>;
     SymbolMap m_symbols;
-    AstNode& m_root_ast_node;
+    AstNode const* m_root_ast_node = nullptr;
+    FlatAst const* m_root_flat_ast = nullptr;
+    bool m_declarations_only = false;
 };
 
-boost::optional<std::vector<SymbolTable::Entry*>> SymbolTable::Lookup(const char *symbol)
+boost::optional<std::vector<SymbolTable::Entry*>> SymbolTable::Lookup(Symbol symbol)
 {
-    auto symbols = m_symbols.find(symbol);
-    if(symbols == m_symbols.end())
+    auto symbols = m_symbols.equal_range(symbol);
+    if(symbols.first == symbols.second)
         return boost::none;
 
     std::vector<Entry*> result;
-    while(symbols != m_symbols.end()) {
-        result.emplace_back(&symbols->second);
-        ++symbols;
-    }
+    for(auto it = symbols.first; it != symbols.second; ++it)
+        result.emplace_back(&it->second);
     return result;
 }
 
-boost::optional<std::vector<SymbolTable::Entry*>> SymbolTable::Lookup(const std::string& symbol) {
-    return Lookup(symbol.c_str());
+boost::optional<std::vector<SymbolTable::Entry*>> SymbolTable::Lookup(std::string_view name)
+{
+    auto symbol = Symbol::Find(name);
+    if(symbol == Symbol())
+        return boost::none;
+    return Lookup(symbol);
 }
 
 void SymbolTable::Generate() {
-    Generate(m_root_ast_node);
+    if(m_root_flat_ast)
+        Generate(*m_root_flat_ast);
+    else
+        Generate(*m_root_ast_node);
 }
 
-SymbolTable::Entry make_entry(SymbolTable::Category symbol_type, SymbolPath symbol_path, AstNode const* ptr = nullptr) {
+void SymbolTable::GenerateDeclarations() {
+    m_declarations_only = true;
+    Generate();
+    m_declarations_only = false;
+}
+
+SymbolTable::Entry make_entry(SymbolTable::Category symbol_type, SymbolPath symbol_path, AstNode const* ptr = nullptr, uint32_t offset = 0) {
     SymbolTable::Entry entry;
+    entry.offset = offset;
     entry.category = symbol_type;
     entry.path = symbol_path;
     entry.node_ptr = ptr;
@@ -91,10 +111,11 @@ SymbolTable::Entry make_entry(SymbolTable::Category symbol_type, SymbolPath symb
 void SymbolTable::Generate(AstNode const& node, SymbolPath path) {
     auto gen_visitor = boost::hana::overload(
         [&](LetNode const& ln) {
-            m_symbols.emplace(ln.var_name, make_entry(Variable{}, path, &node));
+            m_symbols.emplace(ln.var_name, make_entry(Variable{}, path, &node, ln.offset));
         },
         [&](StatementNode const& sn) {
-            Generate(sn.expr, path);
+            if(sn.expr)
+                Generate(*sn.expr, path);
         },
         [&](BlockNode const& bn) {
             for(auto const& statement : bn.statements) {
@@ -102,10 +123,10 @@ void SymbolTable::Generate(AstNode const& node, SymbolPath path) {
             }
         },
         [&](ParameterNode const& pn) {
-            m_symbols.emplace(pn.name, make_entry(Variable{}, path, &node));
+            m_symbols.emplace(pn.name, make_entry(Variable{}, path, &node, pn.offset));
         },
         [&](FunctionNode const& fn) {
-            m_symbols.emplace(fn.name, make_entry(Function{}, path, &node));
+            m_symbols.emplace(fn.name, make_entry(Function{}, path, &node, fn.offset));
 
            path.push_back(fn.name);
 
@@ -113,7 +134,8 @@ void SymbolTable::Generate(AstNode const& node, SymbolPath path) {
                Generate(param, path);
            }
 
-           Generate(fn.func_body, path);
+           if(!m_declarations_only)
+               Generate(fn.Body(), path);
         },
         [&](ModuleNode const & mn) {
             if(mn.name) {
@@ -135,7 +157,66 @@ void SymbolTable::Generate(AstNode const& node, SymbolPath path) {
     boost::apply_visitor(gen_visitor, node);
 }
 
-void print_symbol_table(SymbolTable const& table) {
+// Same entries as generating from the tree, in one forward pass over the
+// nodes. Names are only declared above expressions, so the subtree of a let
+// or parameter is stepped over. A function or named module is on the path of
+// the nodes below it, until the end of its subtree.
+void SymbolTable::Generate(FlatAst const& ast) {
+    SymbolPath path;
+    std::vector<size_t> path_depths;
+    std::vector<uint32_t> ends;     //Subtree ends of the ancestors of node i
+
+    uint32_t size = uint32_t(ast.size());
+    for(uint32_t i = 0; i < size; ) {
+        while(!ends.empty() && ends.back() <= i) {
+            ends.pop_back();
+            if(!path_depths.empty() && path_depths.back() == ends.size()) {
+                path_depths.pop_back();
+                path.pop_back();
+            }
+        }
+        uint32_t end = ast.End(i, ends.empty() ? size : ends.back());
+
+        auto add = [&](Category category, uint32_t offset) {
+            auto entry = make_entry(category, path, nullptr, offset);
+            entry.flat_node = i;
+            m_symbols.emplace(ast.Name(i), entry);
+        };
+
+        switch(ast.kinds[i]) {
+        case F_LET:
+        case F_PARAMETER:
+            add(Variable{}, ast.offsets[i]);
+            i = end;
+            continue;
+        case F_FUNCTION:
+            add(Function{}, ast.offsets[i]);
+            path.push_back(ast.Name(i));
+            path_depths.push_back(ends.size());
+            break;
+        case F_BLOCK:
+            if(m_declarations_only) {
+                i = end;
+                continue;
+            }
+            break;
+        case F_MODULE:
+            if(ast.flags[i] & F_HAS_NAME) {
+                add(Module{}, 0);
+                path.push_back(ast.Name(i));
+                path_depths.push_back(ends.size());
+            }
+            break;
+        default:
+            break;
+        }
+        ends.push_back(end);
+        ++i;
+    }
+}
+
+// Prints line:column of each symbol when given the line table of the source
+void print_symbol_table(SymbolTable const& table, LineTable const* lines = nullptr) {
     std::cout << "SYMBOLS:\n";
     for(auto const& symbol : table.m_symbols) {
         std::cout << "\t" << symbol.first << "\t";
@@ -159,6 +240,10 @@ void print_symbol_table(SymbolTable const& table) {
         for(auto const& a : symbol.second.path) {
             std::cout << "::" << a;
         }
+        if(lines) {
+            auto location = lines->Resolve(symbol.second.offset);
+            std::cout << "\t" << location.line << ":" << location.column;
+        }
         std::cout << "\n";
     }
 }